@@ -0,0 +1,487 @@
+/*
+ * stegfs ~ a steganographic file system for unix-like systems
+ * Copyright © 2007-2021, albinoloverats ~ Software Development
+ * email: stegfs@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <gcrypt.h>
+
+/* submodule includes */
+
+#include "common.h"
+#include "error.h"
+#include "mem.h"
+#include "ccrypt.h"
+#include "dir.h"
+#include "config.h"
+
+/* project includes */
+
+#include "stegfs.h"
+
+
+#define CONVERT "stegfs-convert"
+#define CONVERT_CHUNK 0x100000 /* 1 MiB of a file passed between the processes at a time */
+
+
+/*
+ * what’s sent ahead of each file’s data, from the process reading the
+ * old file system to the one writing the new; if the file couldn’t be
+ * read then there’s no data, just why not
+ */
+typedef struct
+{
+	int32_t  error;
+	uint32_t copies;
+	uint64_t size;
+	uint64_t time;
+}
+convert_record_s;
+
+/*
+ * a lane of the pipeline: the files it converts (every lanes’th of the
+ * manifest, starting from its own) and the pipe it passes them through
+ */
+typedef struct
+{
+	unsigned lane;
+	int      fd;
+}
+convert_lane_s;
+
+
+static char **manifest = NULL;
+static size_t entries = 0;
+static unsigned lanes = 0;
+
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t converted = 0;
+static size_t failed = 0;
+
+
+static bool pipe_read(int fd, void *buffer, size_t size)
+{
+	for (ssize_t r; size; buffer += r, size -= r)
+		if ((r = read(fd, buffer, size)) <= 0)
+		{
+			if (r < 0 && errno == EINTR)
+			{
+				r = 0;
+				continue;
+			}
+			return errno = r ? errno : EIO, false;
+		}
+	return true;
+}
+
+static bool pipe_write(int fd, const void *buffer, size_t size)
+{
+	for (ssize_t r; size; buffer += r, size -= r)
+		if ((r = write(fd, buffer, size)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				r = 0;
+				continue;
+			}
+			return false;
+		}
+	return true;
+}
+
+/*
+ * say how converting a file went; the entry is shown without its
+ * password
+ */
+static void report(const char * const restrict entry, int error)
+{
+	char *path = dir_get_path(entry);
+	char *name = dir_get_name(entry, PASSWORD_SEPARATOR);
+	pthread_mutex_lock(&report_mutex);
+	printf("%s/%s : %s\n", path_equals(path, DIR_SEPARATOR) ? "" : path, name, error ? strerror(error) : "Done");
+	if (error)
+		failed++;
+	else
+		converted++;
+	pthread_mutex_unlock(&report_mutex);
+	free(path);
+	free(name);
+	return;
+}
+
+/*
+ * read each file of a lane from the old file system (with the old
+ * scheme, whatever that was) and pass it down the pipe
+ */
+static void *convert_reader(void *arg)
+{
+	const convert_lane_s *lane = arg;
+	uint8_t *buffer = m_malloc(CONVERT_CHUNK);
+	for (size_t i = lane->lane; i < entries; i += lanes)
+	{
+		convert_record_s record = { 0 };
+		stegfs_file_create(manifest[i], false);
+		stegfs_cache_s *c = stegfs_cache_exists(manifest[i], NULL);
+		if (!c || !c->file)
+			record.error = EISDIR;
+		/*
+		 * all of the file is loaded (and checked) before anything is
+		 * sent, as once the data is on its way the other side can’t be
+		 * told it’s no good
+		 */
+		else if (!stegfs_file_read(c->file) || !stegfs_file_load(c->file, 0, c->file->size))
+			record.error = errno ? : EIO;
+		else
+		{
+			record.copies = c->file->copies;
+			record.size = c->file->size;
+			record.time = c->file->time;
+		}
+		bool r = pipe_write(lane->fd, &record, sizeof record);
+		for (uint64_t o = 0; r && o < record.size; o += CONVERT_CHUNK)
+		{
+			size_t l = record.size - o < CONVERT_CHUNK ? record.size - o : CONVERT_CHUNK;
+			stegfs_data_read(c->file, buffer, l, o);
+			r = pipe_write(lane->fd, buffer, l);
+		}
+		/*
+		 * closing the file lets go of its data; the entry itself is
+		 * left in the cache, as the other lanes search it without the
+		 * lock (the old file system is read-only) and so might still
+		 * be looking at it
+		 */
+		if (c && c->file)
+			stegfs_file_close(c->file);
+		if (!r)
+			break;
+	}
+	free(buffer);
+	close(lane->fd);
+	return NULL;
+}
+
+/*
+ * take each file of a lane from the pipe and write it to the new file
+ * system (in its format)
+ */
+static void *convert_writer(void *arg)
+{
+	const convert_lane_s *lane = arg;
+	stegfs_s file_system = stegfs_info();
+	uint8_t *buffer = m_malloc(CONVERT_CHUNK);
+	size_t i = lane->lane;
+	for (; i < entries; i += lanes)
+	{
+		convert_record_s record;
+		if (!pipe_read(lane->fd, &record, sizeof record))
+			break;
+		if (record.error)
+		{
+			report(manifest[i], record.error);
+			continue;
+		}
+		stegfs_file_create(manifest[i], true);
+		stegfs_cache_s *c = stegfs_cache_exists(manifest[i], NULL);
+		int e = !c || !c->file ? EISDIR : EXIT_SUCCESS;
+		if (!e && !stegfs_file_will_fit(c->file, record.size))
+			e = errno;
+		/* the whole file comes down the pipe, whether or not it can be written */
+		bool r = true;
+		for (uint64_t o = 0; r && o < record.size; o += CONVERT_CHUNK)
+		{
+			size_t l = record.size - o < CONVERT_CHUNK ? record.size - o : CONVERT_CHUNK;
+			if ((r = pipe_read(lane->fd, buffer, l)) && !e)
+				stegfs_data_write(c->file, buffer, l, o);
+		}
+		if (!r)
+			e = EIO;
+		if (!e)
+		{
+			/* a file keeps its own number of copies, if it had one and the new file system can have it */
+			if (record.copies > file_system.stripe && record.copies <= file_system.copies)
+				c->file->copies = record.copies;
+			c->file->size = record.size;
+			c->file->time = record.time;
+			stegfs_file_dirty(c->file, 0, record.size);
+			if (!stegfs_file_close(c->file))
+				e = errno ? : EIO;
+		}
+		else if (c && c->file)
+		{
+			c->file->write = false;
+			stegfs_file_close(c->file);
+		}
+		stegfs_cache_remove(manifest[i]);
+		report(manifest[i], e);
+		if (!r)
+		{
+			i += lanes;
+			break;
+		}
+	}
+	/* anything the other side never sent wasn’t converted */
+	for (; i < entries; i += lanes)
+		report(manifest[i], EIO);
+	free(buffer);
+	close(lane->fd);
+	return NULL;
+}
+
+/*
+ * start a thread for each lane, and wait for them all to finish
+ */
+static void convert_lanes(void *(*worker)(void *), const int *fds)
+{
+	pthread_t *threads = m_calloc(lanes, sizeof( pthread_t ));
+	convert_lane_s *lane = m_calloc(lanes, sizeof( convert_lane_s ));
+	for (unsigned i = 0; i < lanes; i++)
+	{
+		lane[i].lane = i;
+		lane[i].fd = fds[i];
+		if (pthread_create(&threads[i], NULL, worker, &lane[i]))
+			die("Could not start thread %u", i);
+	}
+	for (unsigned i = 0; i < lanes; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(lane);
+	return;
+}
+
+static bool convert_init(const char * const restrict fs, bool paranoid, enum gcry_cipher_algos cipher, enum gcry_cipher_modes mode, enum gcry_md_algos hash, enum gcry_mac_algos mac, uint64_t kdf, uint32_t dups, bool read_only)
+{
+	switch (stegfs_init(fs, paranoid, cipher, mode, hash, mac, kdf, dups, false, false, 0, read_only))
+	{
+		case STEGFS_INIT_OKAY:
+			return true;
+		case STEGFS_INIT_NOT_STEGFS:
+			fprintf(stderr, "Not a stegfs partition! (%s)\n", fs);
+			break;
+		case STEGFS_INIT_OLD_STEGFS:
+			fprintf(stderr, "Previous (unsupported) version of stegfs! (%s)\n", fs);
+			break;
+		case STEGFS_INIT_MISSING_TAG:
+			fprintf(stderr, "Missing required stegfs metadata! (%s)\n", fs);
+			break;
+		case STEGFS_INIT_INVALID_TAG:
+			fprintf(stderr, "Invalid value for stegfs metadata! (%s)\n", fs);
+			break;
+		case STEGFS_INIT_CORRUPT_TAG:
+			fprintf(stderr, "Partition size mismatch! (%s)\n", fs);
+			break;
+		default:
+			fprintf(stderr, "Unknown error initialising stegfs partition! (%s)\n", fs);
+			break;
+	}
+	return false;
+}
+
+/*
+ * read the manifest: a file on each line, as it would be given to the
+ * file system (its path, name and password); blank lines, and lines
+ * starting with #, are skipped
+ */
+static bool manifest_read(const char * const restrict path)
+{
+	FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f)
+		return false;
+	char *line = NULL;
+	size_t length = 0;
+	for (ssize_t l; (l = getline(&line, &length, f)) >= 0; )
+	{
+		while (l && (line[l - 1] == '\n' || line[l - 1] == '\r'))
+			line[--l] = '\0';
+		if (!l || line[0] == '#')
+			continue;
+		manifest = m_realloc(manifest, (entries + 1) * sizeof( char * ));
+		if (line[0] == *DIR_SEPARATOR)
+			manifest[entries++] = m_strdup(line);
+		else
+			manifest[entries++] = m_strdupf("%s%s", DIR_SEPARATOR, line);
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	list_t args = list_init(config_named_compare, false, false);
+	list_add(args, &((config_named_s){ 'c', "cipher",         _("algorithm"),  _("Algorithm the old file system was encrypted with (only needed in paranoia mode)"), { CONFIG_ARG_REQ_STRING,  { .string  = NULL  } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 's', "hash",           _("algorithm"),  _("Hash algorithm the old file system’s keys were generated with"),                   { CONFIG_ARG_REQ_STRING,  { .string  = NULL  } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'm', "mode",           _("mode"),       _("The encryption mode of the old file system"),                                      { CONFIG_ARG_REQ_STRING,  { .string  = NULL  } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'a', "mac",            _("mac"),        _("The MAC algorithm of the old file system"),                                        { CONFIG_ARG_REQ_STRING,  { .string  = NULL  } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'i', "kdf-iterations", _("iterations"), _("Number of iterations the old file system’s KDF used"),                             { CONFIG_ARG_REQ_INTEGER, { .integer = 0     } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'p', "paranoid",       NULL,            _("The old file system was made in paranoia mode"),                                   { CONFIG_ARG_BOOLEAN,     { .boolean = false } }, false, true,  false, false }));
+	list_add(args, &((config_named_s){ 'x', "duplicates",     "#",             _("Number of times each file of the old file system was duplicated"),                 { CONFIG_ARG_REQ_INTEGER, { .integer = 0     } }, false, true,  false, false }));
+	list_add(args, &((config_named_s){ 'j', "jobs",           "#",             _("Number of files converted at once (defaults to the number of processors)"),        { CONFIG_ARG_REQ_INTEGER, { .integer = 0     } }, false, false, false, false }));
+
+	list_t extra = list_default();
+	list_add(extra, &((config_unnamed_s){ "old file system", { CONFIG_ARG_STRING,  { .string = NULL } }, true,  false }));
+	list_add(extra, &((config_unnamed_s){ "new file system", { CONFIG_ARG_STRING,  { .string = NULL } }, true,  false }));
+	list_add(extra, &((config_unnamed_s){ "manifest",        { CONFIG_ARG_STRING,  { .string = NULL } }, true,  false }));
+
+	list_t notes = list_default();
+	list_add(notes, _("The new file system must already exist (made with mkstegfs, with whatever options it should have); files are converted in to it, in its format, and the old file system is left as it was."));
+	list_add(notes, _("The manifest lists the files to convert, one on each line, as they would be given to stegfs: /path/to/file:password"));
+
+	config_about_s about =
+	{
+		CONVERT,
+		STEGFS_VERSION,
+		PROJECT_URL,
+		NULL
+	};
+	config_init(about);
+	config_parse(argc, argv, args, extra, notes);
+
+	list_deinit(notes);
+
+	char *from = ((config_unnamed_s *)list_get(extra, 0))->response.value.string;
+	char *to   = ((config_unnamed_s *)list_get(extra, 1))->response.value.string;
+	char *list = ((config_unnamed_s *)list_get(extra, 2))->response.value.string;
+
+	list_deinit(extra);
+
+	/* the old file system is read from its superblock, unless it hasn’t one */
+	enum gcry_cipher_algos cipher = DEFAULT_CIPHER;
+	enum gcry_cipher_modes mode   = DEFAULT_MODE;
+	enum gcry_md_algos     hash   = DEFAULT_HASH;
+	enum gcry_mac_algos    mac    = DEFAULT_MAC;
+	uint64_t kdf                  = DEFAULT_KDF_ITERATIONS;
+	bool paranoid                 = ((config_named_s *)list_get(args, 5))->response.value.boolean;
+	uint32_t duplicates           = COPIES_DEFAULT;
+	if (paranoid)
+	{
+		char *c = ((config_named_s *)list_get(args, 0))->response.value.string;
+		char *h = ((config_named_s *)list_get(args, 1))->response.value.string;
+		char *m = ((config_named_s *)list_get(args, 2))->response.value.string;
+		char *a = ((config_named_s *)list_get(args, 3))->response.value.string;
+		if (c)
+			cipher = cipher_id_from_name(c);
+		if (h)
+			hash = hash_id_from_name(h);
+		if (m)
+			mode = mode_id_from_name(m);
+		if (a)
+			mac = mac_id_from_name(a);
+		kdf = ((config_named_s *)list_get(args, 4))->response.value.integer ? : DEFAULT_KDF_ITERATIONS;
+		duplicates = (uint32_t)((config_named_s *)list_get(args, 6))->response.value.integer ? : COPIES_DEFAULT;
+		free(c);
+		free(h);
+		free(m);
+		free(a);
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	lanes = (unsigned)((config_named_s *)list_get(args, 7))->response.value.integer ? : (cpus > 0 ? (unsigned)cpus : 1);
+
+	list_deinit(args);
+
+	/*
+	 * each file system is opened by a process of its own (as only one
+	 * can be open at a time), so they can’t be the same
+	 */
+	struct stat s1 = { 0x0 };
+	struct stat s2 = { 0x0 };
+	if (!stat(from, &s1) && !stat(to, &s2) && s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino)
+	{
+		fprintf(stderr, "Can’t convert a file system in to itself; make a new one (with mkstegfs) to convert in to\n");
+		return EXIT_FAILURE;
+	}
+	if (!manifest_read(list))
+	{
+		fprintf(stderr, "Could not read manifest \"%s\"\n", list);
+		return EXIT_FAILURE;
+	}
+	if (!entries)
+		return EXIT_SUCCESS;
+	if (lanes > entries)
+		lanes = entries;
+
+	/*
+	 * a pipe for each lane; the old file system is read in a child
+	 * process while this one writes the new, so that decrypting the
+	 * next files overlaps with encrypting (and writing) those before
+	 */
+	int *readers = m_calloc(lanes, sizeof( int ));
+	int *writers = m_calloc(lanes, sizeof( int ));
+	for (unsigned i = 0; i < lanes; i++)
+	{
+		int p[2];
+		if (pipe(p))
+			die("Could not create pipe");
+		/* (with room for a chunk or so in flight) */
+		fcntl(p[1], F_SETPIPE_SZ, CONVERT_CHUNK);
+		readers[i] = p[0];
+		writers[i] = p[1];
+	}
+	signal(SIGPIPE, SIG_IGN);
+	fflush(NULL);
+	pid_t child = fork();
+	if (child < 0)
+		die("Could not fork");
+	if (!child)
+	{
+		for (unsigned i = 0; i < lanes; i++)
+			close(readers[i]);
+		if (!convert_init(from, paranoid, cipher, mode, hash, mac, kdf, duplicates, true))
+			_exit(EXIT_FAILURE);
+		convert_lanes(convert_reader, writers);
+		stegfs_deinit();
+		_exit(EXIT_SUCCESS);
+	}
+	for (unsigned i = 0; i < lanes; i++)
+		close(writers[i]);
+	if (!convert_init(to, false, DEFAULT_CIPHER, DEFAULT_MODE, DEFAULT_HASH, DEFAULT_MAC, DEFAULT_KDF_ITERATIONS, COPIES_DEFAULT, false))
+	{
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+		return EXIT_FAILURE;
+	}
+	convert_lanes(convert_writer, readers);
+	stegfs_deinit();
+
+	int status = EXIT_FAILURE;
+	waitpid(child, &status, 0);
+	free(readers);
+	free(writers);
+	for (size_t i = 0; i < entries; i++)
+		free(manifest[i]);
+	free(manifest);
+
+	printf("Converted    : %zu\n", converted);
+	printf("Failed       : %zu\n", failed);
+	return failed || !WIFEXITED(status) || WEXITSTATUS(status) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
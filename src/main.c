@@ -22,7 +22,10 @@
 #include <errno.h>
 #include <error.h>
 
-#define FUSE_USE_VERSION 27
+/* FUSE 2 unless built for FUSE 3 (see the Makefile) */
+#ifndef FUSE_USE_VERSION
+	#define FUSE_USE_VERSION 27
+#endif
 #include <fuse.h>
 
 #include <stdio.h>
@@ -52,34 +55,69 @@
 #include "stegfs.h"
 
 
+/* FUSE 3 gives each directory entry flags too */
+#if FUSE_USE_VERSION >= 30
+	#define fuse_fill(filler, buf, name) filler(buf, name, NULL, 0, 0)
+#else
+	#define fuse_fill(filler, buf, name) filler(buf, name, NULL, 0)
+#endif
+
 /*
  * standard file system functions (used by fuse)
  */
 static int fuse_stegfs_statfs(const char *, struct statvfs *);
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_getattr(const char *, struct stat *, struct fuse_file_info *);
+#else
 static int fuse_stegfs_getattr(const char *, struct stat *);
+#endif
 static int fuse_stegfs_mkdir(const char *, mode_t);
 static int fuse_stegfs_rmdir(const char *);
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_readdir(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *, enum fuse_readdir_flags);
+#else
 static int fuse_stegfs_readdir(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
+#endif
 static int fuse_stegfs_unlink(const char *);
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_rename(const char *, const char *, unsigned int);
+#else
+static int fuse_stegfs_rename(const char *, const char *);
+#endif
 static int fuse_stegfs_read(const char *, char *, size_t, off_t , struct fuse_file_info *);
 static int fuse_stegfs_write(const char *, const char *, size_t, off_t , struct fuse_file_info *);
 static int fuse_stegfs_open(const char *, struct fuse_file_info *);
 static int fuse_stegfs_release(const char *, struct fuse_file_info *);
+#if FUSE_USE_VERSION < 30
 static int fuse_stegfs_truncate(const char *, off_t);
+#endif
 static int fuse_stegfs_ftruncate(const char *, off_t, struct fuse_file_info *);
-#ifdef STEGFS_FALLOCATE
+#if FUSE_VERSION >= 29
 static int fuse_stegfs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
 #endif
+#if FUSE_USE_VERSION >= 30 && FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+static ssize_t fuse_stegfs_copy_file_range(const char *, struct fuse_file_info *, off_t, const char *, struct fuse_file_info *, off_t, size_t, int);
+#endif
 static int fuse_stegfs_create(const char *, mode_t, struct fuse_file_info *);
 static int fuse_stegfs_mknod(const char *, mode_t, dev_t);
+static int fuse_stegfs_setxattr(const char *, const char *, const char *, size_t, int);
+static int fuse_stegfs_getxattr(const char *, const char *, char *, size_t);
+static int fuse_stegfs_listxattr(const char *, char *, size_t);
+static int fuse_stegfs_removexattr(const char *, const char *);
 static void fuse_stegfs_destroy(void *);
 /*
  * empty functions; required by fuse, but not used by stegfs
  */
 static int fuse_stegfs_readlink(const char *, char *, size_t);
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_utimens(const char *, const struct timespec [2], struct fuse_file_info *);
+static int fuse_stegfs_chmod(const char *, mode_t, struct fuse_file_info *);
+static int fuse_stegfs_chown(const char *, uid_t, gid_t, struct fuse_file_info *);
+#else
 static int fuse_stegfs_utime(const char *, struct utimbuf *);
 static int fuse_stegfs_chmod(const char *, mode_t);
 static int fuse_stegfs_chown(const char *, uid_t, gid_t);
+#endif
 static int fuse_stegfs_flush(const char *, struct fuse_file_info *);
 
 static struct fuse_operations fuse_stegfs_functions =
@@ -90,23 +128,40 @@ static struct fuse_operations fuse_stegfs_functions =
 	.rmdir     = fuse_stegfs_rmdir,
 	.readdir   = fuse_stegfs_readdir,
 	.unlink    = fuse_stegfs_unlink,
+	.rename    = fuse_stegfs_rename,
 	.read      = fuse_stegfs_read,
 	.write     = fuse_stegfs_write,
 	.open      = fuse_stegfs_open,
 	.release   = fuse_stegfs_release,
+#if FUSE_USE_VERSION >= 30
+	/* (FUSE 3 passes the open file, if there is one, to truncate) */
+	.truncate  = fuse_stegfs_ftruncate,
+#else
 	.truncate  = fuse_stegfs_truncate,
 	.ftruncate = fuse_stegfs_ftruncate,
-#ifdef STEGFS_FALLOCATE
+#endif
+#if FUSE_VERSION >= 29
 	.fallocate = fuse_stegfs_fallocate,
+#endif
+#if FUSE_USE_VERSION >= 30 && FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+	.copy_file_range = fuse_stegfs_copy_file_range,
 #endif
 	.create    = fuse_stegfs_create,
 	.mknod     = fuse_stegfs_mknod,
+	.setxattr  = fuse_stegfs_setxattr,
+	.getxattr  = fuse_stegfs_getxattr,
+	.listxattr = fuse_stegfs_listxattr,
+	.removexattr = fuse_stegfs_removexattr,
 	.destroy   = fuse_stegfs_destroy,
 	.readlink  = fuse_stegfs_readlink,
 	/*
 	 * empty functions; required by fuse, but not used by stegfs
 	 */
+#if FUSE_USE_VERSION >= 30
+	.utimens   = fuse_stegfs_utimens,
+#else
 	.utime     = fuse_stegfs_utime,
+#endif
 	.chmod     = fuse_stegfs_chmod,
 	.chown     = fuse_stegfs_chown,
 	.flush     = fuse_stegfs_flush
@@ -125,23 +180,33 @@ static int fuse_stegfs_statfs(const char *path, struct statvfs *stvbuf)
 
 	stegfs_s file_system = stegfs_info();
 
-	stvbuf->f_bsize   = SIZE_BYTE_BLOCK;
-	stvbuf->f_frsize  = SIZE_BYTE_DATA;
-	stvbuf->f_blocks  = (file_system.size / SIZE_BYTE_BLOCK) - 1;
+	stvbuf->f_bsize   = file_system.blocksize;
+	stvbuf->f_frsize  = SIZE_BYTE_DATA_IN(file_system.blocksize);
+	stvbuf->f_blocks  = (file_system.size / file_system.blocksize) - 1;
 	stvbuf->f_bfree   = stvbuf->f_blocks - file_system.blocks.used;
-	stvbuf->f_bavail  = stvbuf->f_bfree;
+	stvbuf->f_bavail  = stvbuf->f_bfree > file_system.blocks.reserved ? stvbuf->f_bfree - file_system.blocks.reserved : 0;
 	stvbuf->f_files   = stvbuf->f_blocks;
 	stvbuf->f_ffree   = stvbuf->f_bfree;
 	stvbuf->f_favail  = stvbuf->f_bfree;
 	stvbuf->f_fsid    = HASH_MAGIC_2;
-	stvbuf->f_flag    = ST_NOSUID;
+	stvbuf->f_flag    = ST_NOSUID | (file_system.read_only ? ST_RDONLY : 0);
 	stvbuf->f_namemax = SYM_LENGTH;
 
 	return -errno;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *info)
+#else
 static int fuse_stegfs_getattr(const char *path, struct stat *stbuf)
+#endif
 {
+#if FUSE_USE_VERSION >= 30
+	(void)info;
+#endif
+	/* wait for the file to be written, if it was closed recently */
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
 	stegfs_s file_system = stegfs_info();
@@ -198,7 +263,7 @@ static int fuse_stegfs_getattr(const char *path, struct stat *stbuf)
 				for (unsigned i = 0; i < file_system.copies; i++)
 					if (c.file->inodes[i])
 					{
-						stbuf->st_ino = (ino_t)(c.file->inodes[i] % (file_system.size / SIZE_BYTE_BLOCK));
+						stbuf->st_ino = (ino_t)(c.file->inodes[i] % (file_system.size / file_system.blocksize));
 						break;
 					}
 				/* it makes little sense (right now) to set this to anything else */
@@ -228,7 +293,7 @@ static int fuse_stegfs_getattr(const char *path, struct stat *stbuf)
 				for (unsigned i = 0; i < file_system.copies; i++)
 					if (file.inodes[i])
 					{
-						stbuf->st_ino = (ino_t)(file.inodes[i] % (file_system.size / SIZE_BYTE_BLOCK));
+						stbuf->st_ino = (ino_t)(file.inodes[i] % (file_system.size / file_system.blocksize));
 						break;
 					}
 				stbuf->st_mode  = S_IFREG | S_IRUSR | S_IWUSR;
@@ -246,7 +311,7 @@ static int fuse_stegfs_getattr(const char *path, struct stat *stbuf)
 	if (stbuf->st_mode & S_IFREG)
 	{
 		stbuf->st_nlink = 1;
-		stbuf->st_blksize = SIZE_BYTE_DATA;
+		stbuf->st_blksize = SIZE_BYTE_DATA_IN(file_system.blocksize);
 		lldiv_t d = lldiv(stbuf->st_size, stbuf->st_blksize);
 		stbuf->st_blocks = d.quot + (d.rem > 0);
 	}
@@ -257,8 +322,8 @@ static int fuse_stegfs_getattr(const char *path, struct stat *stbuf)
 		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, strlen(path));
 		memcpy(&(stbuf->st_ino), hash_buffer, sizeof stbuf->st_ino);
 		gcry_free(hash_buffer);
-		stbuf->st_ino %= (file_system.size / SIZE_BYTE_BLOCK);
-		stbuf->st_size = SIZE_BYTE_DATA;
+		stbuf->st_ino %= (file_system.size / file_system.blocksize);
+		stbuf->st_size = SIZE_BYTE_DATA_IN(file_system.blocksize);
 	}
 	free(f);
 
@@ -269,6 +334,9 @@ static int fuse_stegfs_mkdir(const char *path, mode_t mode)
 {
 	errno = EXIT_SUCCESS;
 
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
 	(void)mode;
 
 	stegfs_cache_add(path, NULL);
@@ -280,6 +348,9 @@ static int fuse_stegfs_rmdir(const char *path)
 {
 	errno = EXIT_SUCCESS;
 
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
 	stegfs_s file_system = stegfs_info();
 	if (file_system.show_bloc && path_equals(path, PATH_BLOC))
 		return errno = EBUSY, -errno;
@@ -305,15 +376,22 @@ static int fuse_stegfs_rmdir(const char *path)
 	return -errno;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info, enum fuse_readdir_flags flags)
+#else
 static int fuse_stegfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info)
+#endif
 {
 	errno = EXIT_SUCCESS;
 
 	(void)offset;
 	(void)info;
+#if FUSE_USE_VERSION >= 30
+	(void)flags;
+#endif
 
-	filler(buf,  ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	fuse_fill(filler, buf, ".");
+	fuse_fill(filler, buf, "..");
 
 	stegfs_s file_system = stegfs_info();
 
@@ -321,16 +399,16 @@ static int fuse_stegfs_readdir(const char *path, void *buf, fuse_fill_dir_t fill
 	{
 		for (uint64_t i = 0; i < file_system.cache.ents; i++)
 			if (file_system.cache.child[i]->name)
-				filler(buf, file_system.cache.child[i]->name, NULL, 0);
+				fuse_fill(filler, buf, file_system.cache.child[i]->name);
 	}
 	else if (file_system.show_bloc && path_equals(PATH_BLOC, path))
 	{
-		for (uint64_t i = 0; i < file_system.size / SIZE_BYTE_BLOCK; i++)
+		for (uint64_t i = 0; i < file_system.size / file_system.blocksize; i++)
 			if (file_system.blocks.in_use[i])
 			{
 				char b[21] = { 0x0 }; // max digits for UINT64_MAX
 				snprintf(b, sizeof b, "%ju", i);
-				filler(buf, b, NULL, 0);
+				fuse_fill(filler, buf, b);
 			}
 	}
 	else
@@ -340,7 +418,7 @@ static int fuse_stegfs_readdir(const char *path, void *buf, fuse_fill_dir_t fill
 		if (stegfs_cache_exists(path, &c))
 			for (uint64_t i = 0; i < c.ents; i++)
 				if (c.child[i]->name)
-					filler(buf, c.child[i]->name, NULL, 0);
+					fuse_fill(filler, buf, c.child[i]->name);
 	}
 
 	return -errno;
@@ -348,8 +426,13 @@ static int fuse_stegfs_readdir(const char *path, void *buf, fuse_fill_dir_t fill
 
 static int fuse_stegfs_unlink(const char *path)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
 	stegfs_file_s file;
 	memset(&file, 0x00, sizeof file);
 	file.path = dir_get_path(path);
@@ -365,8 +448,82 @@ static int fuse_stegfs_unlink(const char *path)
 	return -errno;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_rename(const char *from, const char *to, unsigned int flags)
+#else
+static int fuse_stegfs_rename(const char *from, const char *to)
+#endif
+{
+	stegfs_file_wait(from);
+	stegfs_file_wait(to);
+
+	errno = EXIT_SUCCESS;
+
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
+	stegfs_s file_system = stegfs_info();
+	if (file_system.show_bloc && (path_starts_with(PATH_BLOC, from) || path_starts_with(PATH_BLOC, to)))
+		return errno = EACCES, -errno;
+#if FUSE_USE_VERSION >= 30
+	/* two files can’t swap places without one of them being somewhere else first */
+	if (flags & ~RENAME_NOREPLACE)
+		return errno = EINVAL, -errno;
+	if ((flags & RENAME_NOREPLACE) && stegfs_cache_exists(to, NULL))
+		return errno = EEXIST, -errno;
+#endif
+	if (path_equals(from, to))
+		return -errno;
+
+	stegfs_cache_s *c = NULL;
+	if ((c = stegfs_cache_exists(to, NULL)) && !c->file)
+		return errno = EISDIR, -errno;
+	if (!(c = stegfs_cache_exists(from, NULL)))
+	{
+		/* (finding the file adds it to the cache) */
+		stegfs_file_s file;
+		memset(&file, 0x00, sizeof file);
+		file.path = dir_get_path(from);
+		file.name = dir_get_name(from, PASSWORD_SEPARATOR);
+		file.pass = dir_get_pass(from);
+		stegfs_file_stat(&file);
+		free(file.path);
+		free(file.name);
+		free(file.pass);
+		if (!(c = stegfs_cache_exists(from, NULL)))
+			return errno = ENOENT, -errno;
+	}
+	/*
+	 * directories only exist in memory, so moving one would mean moving
+	 * every file below it; mv does that itself when told it can’t
+	 */
+	if (!c->file)
+		return errno = EXDEV, -errno;
+	/* as with truncate, a file which isn’t open needs the password to be read */
+	bool writing = c->file->write;
+	if (!writing)
+	{
+		free(c->file->pass);
+		c->file->pass = dir_get_pass(from);
+	}
+	if (stegfs_file_rename(c->file, to))
+	{
+		errno = EXIT_SUCCESS;
+		c = stegfs_cache_exists(to, NULL);
+	}
+	if (!writing && c && c->file)
+	{
+		free(c->file->pass);
+		c->file->pass = NULL;
+	}
+
+	return -errno;
+}
+
 static int fuse_stegfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
 	(void)info;
@@ -374,9 +531,13 @@ static int fuse_stegfs_read(const char *path, char *buf, size_t size, off_t offs
 	stegfs_cache_s *c = NULL;
 	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
 	{
-		if ((unsigned)(offset + size) > c->file->size)
+		if ((uint64_t)offset >= c->file->size)
+			return 0;
+		if ((uint64_t)(offset + size) > c->file->size)
 			size = c->file->size - offset;
-		memcpy(buf, c->file->data + offset, size);
+		if (!stegfs_file_load(c->file, offset, size))
+			return -errno;
+		stegfs_data_read(c->file, buf, size, offset);
 		return size;
 	}
 
@@ -385,8 +546,13 @@ static int fuse_stegfs_read(const char *path, char *buf, size_t size, off_t offs
 
 static int fuse_stegfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
 	(void)info;
 
 	/*
@@ -398,14 +564,16 @@ static int fuse_stegfs_write(const char *path, const char *buf, size_t size, off
 		stegfs_cache_s *c = NULL;
 		if ((c = stegfs_cache_exists(path, NULL)) && c->file)
 		{
-			if (!stegfs_file_will_fit(c->file))
-				return -errno;
 			if (!c->file->write)
 				return errno = EBADF, -errno;
+			if (!stegfs_file_will_fit(c->file, c->file->size > size + offset ? c->file->size : size + offset))
+				return -errno;
+			if (!stegfs_file_load(c->file, offset, size))
+				return -errno;
+			stegfs_file_dirty(c->file, offset, offset + size);
 			c->file->size = c->file->size > size + offset ? c->file->size : size + offset;
-			c->file->data = m_realloc(c->file->data, c->file->size);
 			c->file->time = time(NULL);
-			memcpy(c->file->data + offset, buf, size);
+			stegfs_data_write(c->file, buf, size, offset);
 			return size;
 		}
 		else if (c && !c->file)
@@ -423,17 +591,35 @@ static int fuse_stegfs_write(const char *path, const char *buf, size_t size, off
 
 static int fuse_stegfs_open(const char *path, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
-	(void)info;
+	if ((info->flags & O_ACCMODE) != O_RDONLY && stegfs_info().read_only)
+		return errno = EROFS, -errno;
 
 	stegfs_cache_s *c = NULL;
 	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
 	{
+		/* already open for writing; the buffer is the latest copy */
+		if (c->file->write)
+			return -errno;
+		free(c->file->pass);
 		c->file->pass = dir_get_pass(path);
-		if (!stegfs_file_read(c->file))
-			errno = EACCES;
-		/* TODO use the fields in info for something meaningful */
+		/*
+		 * when appending only the end of the file is needed (as
+		 * long as its MAC can be carried on from there)
+		 */
+		bool append = (info->flags & O_ACCMODE) != O_RDONLY && (info->flags & O_APPEND);
+		if (append ? !stegfs_file_read_tail(c->file) : !stegfs_file_read(c->file))
+		{
+			/* a file which is being written to needn’t exist yet */
+			if (errno != ENOENT || (info->flags & O_ACCMODE) == O_RDONLY)
+				return errno = EACCES, -errno;
+			errno = EXIT_SUCCESS;
+		}
+		if ((info->flags & O_ACCMODE) != O_RDONLY)
+			c->file->write = true;
 	}
 
 	return -errno;
@@ -441,39 +627,64 @@ static int fuse_stegfs_open(const char *path, struct fuse_file_info *info)
 
 static int fuse_stegfs_flush(const char *path, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
 	(void)info;
 
+	/* only a file being written might not fit (and nothing is when read-only) */
 	stegfs_cache_s *c = NULL;
-	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
-		if (stegfs_file_will_fit(c->file))
+	if ((c = stegfs_cache_exists(path, NULL)) && c->file && c->file->write)
+		if (stegfs_file_will_fit(c->file, c->file->size))
 			errno = EXIT_SUCCESS;
 
 	return -errno;
 }
 
+#if FUSE_USE_VERSION < 30
 static int fuse_stegfs_truncate(const char *path, off_t offset)
 {
 	errno = EXIT_SUCCESS;
 
 	return fuse_stegfs_ftruncate(path, offset, NULL);
 }
+#endif
 
 static int fuse_stegfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
+	(void)info;
+
 	stegfs_cache_s *c = NULL;
 	while (true)
 	{
 		if ((c = stegfs_cache_exists(path, NULL)) && c->file)
 		{
-			char *buf = m_calloc(offset, sizeof(uint8_t));
-			fuse_stegfs_read(path, buf, offset, 0, info);
-			fuse_stegfs_unlink(path);
-			fuse_stegfs_write(path, buf, offset, 0, info);
-			free(buf);
+			/*
+			 * if the file isn’t open then it’s read (if needed)
+			 * and written again straight away, which needs the
+			 * password
+			 */
+			bool writing = c->file->write;
+			if (!writing)
+			{
+				free(c->file->pass);
+				c->file->pass = dir_get_pass(path);
+			}
+			if (stegfs_file_truncate(c->file, offset))
+				errno = EXIT_SUCCESS;
+			if (!writing)
+			{
+				free(c->file->pass);
+				c->file->pass = NULL;
+			}
 			return -errno;
 		}
 		else if (c && !c->file)
@@ -486,67 +697,119 @@ static int fuse_stegfs_ftruncate(const char *path, off_t offset, struct fuse_fil
 
 }
 
-#ifdef STEGFS_FALLOCATE
+#if FUSE_VERSION >= 29
 static int fuse_stegfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
-	/* this isn't finished or working properly */
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
+	(void)info;
+
+	if (offset < 0 || length <= 0)
+		return errno = EINVAL, -errno;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return errno = EOPNOTSUPP, -errno;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+		return errno = EINVAL, -errno;
 
 	stegfs_cache_s *c = NULL;
-	while (true)
+	if (!(c = stegfs_cache_exists(path, NULL)))
+		return errno = ENOENT, -errno;
+	if (!c->file)
+		return errno = EISDIR, -errno;
+	if (!c->file->write)
+		return errno = EBADF, -errno;
+
+	uint64_t sz = offset + length;
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
 	{
-		if ((c = stegfs_cache_exists(path, NULL)) && c->file)
+		/*
+		 * blocks aren’t given back when a hole is punched, as every
+		 * block in a chain must exist; the range just reads as 0's
+		 */
+		uint64_t end = sz < c->file->size ? sz : c->file->size;
+		if ((uint64_t)offset < end)
 		{
-			uint64_t sz = offset + length;
-			switch (mode)
-			{
-				case -1:                        /* emulate truncate */
-					break;
-				case 0:                         /* make bigger (not smaller) */
-					if (sz < c->file->size)
-						sz = c->file->size;
-					break;
-				case FALLOC_FL_KEEP_SIZE:       /* no size change */
-				case FALLOC_FL_PUNCH_HOLE:
-					return errno = EOPNOTSUPP, -errno;
-				case FALLOC_FL_COLLAPSE_RANGE:  /* remove data from middle */
-					if (sz > c->file->size)
-						return errno = EINVAL, -errno;
-				case FALLOC_FL_ZERO_RANGE:      /* does nothing here, but zeros later */
-					break;
-			}
-			char *buf = m_calloc(sz, sizeof(uint8_t));
-			fuse_stegfs_read(path, buf, sz, 0, info);
-			fuse_stegfs_unlink(path);
-			switch (mode)
-			{
-				case FALLOC_FL_COLLAPSE_RANGE:
-					memmove(buf + offset, buf + offset + length, sz - offset - length);
-					sz -= offset - length;
-					break;
-				case FALLOC_FL_ZERO_RANGE:
-					memset(buf + offset, 0x00, length);
-					break;
-			}
-			fuse_stegfs_write(path, buf, sz, 0, info);
-			free(buf);
-			return -errno;
+			if (!stegfs_file_load(c->file, offset, end - offset))
+				return -errno;
+			uint8_t *zero = m_calloc(end - offset, sizeof( uint8_t ));
+			stegfs_data_write(c->file, zero, end - offset, offset);
+			free(zero);
+			stegfs_file_dirty(c->file, offset, end);
+			c->file->time = time(NULL);
 		}
-		else if (c && !c->file)
-			return errno = EISDIR, -errno;
-		else
-			stegfs_file_create(path, true);
+		if (mode & FALLOC_FL_PUNCH_HOLE)
+			return -errno;
+	}
+	/*
+	 * reserve blocks for every copy now, so that writing within the
+	 * range later doesn’t need to find any
+	 */
+	if (!stegfs_file_allocate(c->file, sz))
+		return -errno;
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && sz > c->file->size)
+	{
+		stegfs_file_dirty(c->file, c->file->size, sz);
+		c->file->size = sz;
+		c->file->time = time(NULL);
 	}
 
-	return errno = EIO, -errno;
+	return -errno;
+}
+#endif
+
+#if FUSE_USE_VERSION >= 30 && FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+/*
+ * copy between files without the data leaving stegfs; it’s decrypted
+ * once (if it wasn’t already) and encrypted when the file copied to is
+ * written, rather than passing through the kernel twice on the way
+ */
+static ssize_t fuse_stegfs_copy_file_range(const char *path_in, struct fuse_file_info *info_in, off_t offset_in, const char *path_out, struct fuse_file_info *info_out, off_t offset_out, size_t size, int flags)
+{
+	stegfs_file_wait(path_in);
+	stegfs_file_wait(path_out);
+
+	errno = EXIT_SUCCESS;
+
+	(void)info_in;
+	(void)info_out;
+
+	if (flags || offset_in < 0 || offset_out < 0)
+		return errno = EINVAL, -errno;
+
+	stegfs_cache_s *in = NULL;
+	stegfs_cache_s *out = NULL;
+	if (!(in = stegfs_cache_exists(path_in, NULL)) || !(out = stegfs_cache_exists(path_out, NULL)))
+		return errno = ENOENT, -errno;
+	if (!in->file || !out->file)
+		return errno = EISDIR, -errno;
+	if (!out->file->write)
+		return errno = EBADF, -errno;
+	if ((uint64_t)offset_in >= in->file->size)
+		return 0;
+	if ((uint64_t)offset_in + size > in->file->size)
+		size = in->file->size - offset_in;
+	if (size > SSIZE_MAX)
+		size = SSIZE_MAX;
+	if (!stegfs_file_copy(in->file, offset_in, out->file, offset_out, size))
+		return -errno;
+	return size;
 }
 #endif
 
 static int fuse_stegfs_create(const char *path, mode_t mode, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
 	(void)mode;
 	(void)info;
 
@@ -557,8 +820,13 @@ static int fuse_stegfs_create(const char *path, mode_t mode, struct fuse_file_in
 
 static int fuse_stegfs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
 	(void)mode;
 	(void)rdev;
 
@@ -569,24 +837,129 @@ static int fuse_stegfs_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_stegfs_release(const char *path, struct fuse_file_info *info)
 {
+	stegfs_file_wait(path);
+
 	errno = EXIT_SUCCESS;
 
 	(void)info;
 
 	stegfs_cache_s *c = NULL;
 	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
+		if (stegfs_file_close(c->file))
+			errno = EXIT_SUCCESS;
+
+	return -errno;
+}
+
+/*
+ * the only extended attribute is the number of copies of a file, or of
+ * the files made in a directory
+ */
+static int fuse_stegfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	stegfs_file_wait(path);
+
+	errno = EXIT_SUCCESS;
+
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
+	(void)flags;
+
+	if (strcmp(name, XATTR_COPIES))
+		return errno = ENOTSUP, -errno;
+	char v[11] = { 0x0 };
+	if (!size || size >= sizeof v)
+		return errno = EINVAL, -errno;
+	memcpy(v, value, size);
+	char *e = NULL;
+	uint32_t copies = strtoul(v, &e, 10);
+	if (*e)
+		return errno = EINVAL, -errno;
+
+	stegfs_cache_s *c = NULL;
+	if (path_equals(path, DIR_SEPARATOR) || ((c = stegfs_cache_exists(path, NULL)) && !c->file))
+		stegfs_directory_replicate(path, copies);
+	else if (c)
 	{
-		if (c->file->write && stegfs_file_will_fit(c->file))
+		/* as with truncate, a file which isn’t open is written again straight away */
+		bool writing = c->file->write;
+		if (!writing)
 		{
-			if (stegfs_file_write(c->file))
-				errno = EXIT_SUCCESS;
-			c->file->write = false;
+			free(c->file->pass);
+			c->file->pass = dir_get_pass(path);
+		}
+		if (stegfs_file_replicate(c->file, copies))
+			errno = EXIT_SUCCESS;
+		if (!writing)
+		{
+			free(c->file->pass);
+			c->file->pass = NULL;
 		}
-		free(c->file->data);
-		c->file->data = NULL;
-		free(c->file->pass);
-		c->file->pass = NULL;
 	}
+	else
+		errno = ENOENT;
+
+	return -errno;
+}
+
+static int fuse_stegfs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	errno = EXIT_SUCCESS;
+
+	if (strcmp(name, XATTR_COPIES))
+		return errno = ENODATA, -errno;
+
+	stegfs_s file_system = stegfs_info();
+	stegfs_cache_s *c = NULL;
+	uint32_t copies = 0;
+	if (path_equals(path, DIR_SEPARATOR) || ((c = stegfs_cache_exists(path, NULL)) && !c->file))
+		copies = stegfs_directory_copies(path);
+	else if (c)
+		copies = c->file->copies ? : file_system.copies;
+	else
+		return errno = ENOENT, -errno;
+
+	char v[11] = { 0x0 };
+	int l = snprintf(v, sizeof v, "%" PRIu32, copies);
+	if (!size)
+		return l;
+	if (size < (size_t)l)
+		return errno = ERANGE, -errno;
+	memcpy(value, v, l);
+	return l;
+}
+
+static int fuse_stegfs_listxattr(const char *path, char *list, size_t size)
+{
+	errno = EXIT_SUCCESS;
+
+	(void)path;
+
+	if (!size)
+		return sizeof XATTR_COPIES;
+	if (size < sizeof XATTR_COPIES)
+		return errno = ERANGE, -errno;
+	memcpy(list, XATTR_COPIES, sizeof XATTR_COPIES);
+	return sizeof XATTR_COPIES;
+}
+
+static int fuse_stegfs_removexattr(const char *path, const char *name)
+{
+	errno = EXIT_SUCCESS;
+
+	if (stegfs_info().read_only)
+		return errno = EROFS, -errno;
+
+	if (strcmp(name, XATTR_COPIES))
+		return errno = ENODATA, -errno;
+
+	/* a directory goes back to its parent’s copies; a file can’t have none */
+	stegfs_cache_s *c = NULL;
+	if (path_equals(path, DIR_SEPARATOR) || ((c = stegfs_cache_exists(path, NULL)) && !c->file))
+		stegfs_directory_replicate(path, 0);
+	else
+		errno = c ? ENOTSUP : ENOENT;
 
 	return -errno;
 }
@@ -627,6 +1000,35 @@ static int fuse_stegfs_readlink(const char *path, char *buf, size_t size)
  * empty functions; required by fuse, but not used by stegfs; return ENOTSUP
  */
 
+#if FUSE_USE_VERSION >= 30
+static int fuse_stegfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *info)
+{
+	(void)path;
+	(void)tv;
+	(void)info;
+
+	return errno = ENOTSUP, -errno;
+}
+
+static int fuse_stegfs_chmod(const char *path, mode_t mode, struct fuse_file_info *info)
+{
+	(void)path;
+	(void)mode;
+	(void)info;
+
+	return errno = ENOTSUP, -errno;
+}
+
+static int fuse_stegfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *info)
+{
+	(void)path;
+	(void)uid;
+	(void)gid;
+	(void)info;
+
+	return errno = ENOTSUP, -errno;
+}
+#else
 static int fuse_stegfs_utime(const char *path, struct utimbuf *utime)
 {
 	(void)path;
@@ -651,6 +1053,7 @@ static int fuse_stegfs_chown(const char *path, uid_t uid, gid_t gid)
 
 	return errno = ENOTSUP, -errno;
 }
+#endif
 
 int main(int argc, char **argv)
 {
@@ -666,6 +1069,8 @@ int main(int argc, char **argv)
 	list_add(args, &((config_named_s){ 'p', "paranoid",       NULL,            _("Enable paranoia mode"),                                                             { CONFIG_ARG_BOOLEAN,     { .boolean = false } }, false, true,  false, false }));
 	list_add(args, &((config_named_s){ 'x', "duplicates",     "#",             _("Number of times each file should be duplicated"),                                   { CONFIG_ARG_REQ_INTEGER, { .integer = 0     } }, false, true,  false, false }));
 	list_add(args, &((config_named_s){ 'b', "show-bloc",      NULL,            _("Expose the /bloc/ in-use block list directory"),                                    { CONFIG_ARG_BOOLEAN,     { .boolean = false } }, false, true,  false, false }));
+	list_add(args, &((config_named_s){ 'r', "async-copies",   NULL,            _("Write all but the first copy of each file in the background"),                      { CONFIG_ARG_BOOLEAN,     { .boolean = false } }, false, true,  false, false }));
+	list_add(args, &((config_named_s){ 'w', "flush-threads",  "#",             _("Number of threads writing closed files in the background"),                         { CONFIG_ARG_REQ_INTEGER, { .integer = 0     } }, false, true,  false, false }));
 	list_add(args, &((config_named_s){ 'd', NULL,             NULL,            _("Enable debug output (forces foreground and single-thread)"),                        { CONFIG_ARG_BOOLEAN,     { .boolean = false } }, false, false, false, false }));
 	list_add(args, &((config_named_s){ 'f', NULL,             NULL,            _("Foreground operation"),                                                             { CONFIG_ARG_BOOLEAN,     { .boolean = false } }, false, false, false, false }));
 	list_add(args, &((config_named_s){ 't', NULL,             NULL,            _("Disable multi-threaded operation (FUSE option -s)"),                                { CONFIG_ARG_BOOLEAN,     { .boolean = false } }, false, false, false, false }));
@@ -717,6 +1122,8 @@ int main(int argc, char **argv)
 	bool paranoid                 = ((config_named_s *)list_get(args, 5))->response.value.boolean;
 	uint8_t duplicates            = COPIES_DEFAULT;
 	bool show_bloc                = ((config_named_s *)list_get(args, 7))->response.value.boolean;
+	bool async_copies             = ((config_named_s *)list_get(args, 8))->response.value.boolean;
+	uint32_t flush_threads        = ((config_named_s *)list_get(args, 9))->response.value.integer;
 
 	if (paranoid)
 	{
@@ -732,9 +1139,9 @@ int main(int argc, char **argv)
 	 * deal with FUSE options
 	 */
 
-	bool debug         =          ((config_named_s *)list_get(args,  8))->response.value.boolean;
-	bool foreground    = debug || ((config_named_s *)list_get(args,  9))->response.value.boolean;
-	bool single_thread = debug || ((config_named_s *)list_get(args, 10))->response.value.boolean;
+	bool debug         =          ((config_named_s *)list_get(args, 10))->response.value.boolean;
+	bool foreground    = debug || ((config_named_s *)list_get(args, 11))->response.value.boolean;
+	bool single_thread = debug || ((config_named_s *)list_get(args, 12))->response.value.boolean;
 
 	int fuse_argc = 3;
 	char **fuse_argv = m_calloc(fuse_argc, sizeof (char *));
@@ -758,7 +1165,8 @@ int main(int argc, char **argv)
 		fuse_argv = m_realloc(fuse_argv, fuse_argc * sizeof (char *));
 		fuse_argv[fuse_argc - 2] = "-s";
 	}
-	list_t fuse_options = ((config_named_s *)list_get(args, 11))->response.value.list;
+	list_t fuse_options = ((config_named_s *)list_get(args, 13))->response.value.list;
+	bool read_only = false;
 	iter_t iter = list_iterator(fuse_options);
 	while (list_has_next(iter))
 	{
@@ -766,6 +1174,15 @@ int main(int argc, char **argv)
 		fuse_argv = m_realloc(fuse_argv, fuse_argc * sizeof (char *));
 		fuse_argv[fuse_argc - 3] = "-o";
 		fuse_argv[fuse_argc - 2] = (char *)list_get_next(iter);
+		/* stegfs needs to know it’s mounted read-only too (the last of ro/rw wins, as with mount) */
+		char *o = m_strdup(fuse_argv[fuse_argc - 2]);
+		char *save = NULL;
+		for (char *t = strtok_r(o, ",", &save); t; t = strtok_r(NULL, ",", &save))
+			if (!strcmp(t, "ro"))
+				read_only = true;
+			else if (!strcmp(t, "rw"))
+				read_only = false;
+		free(o);
 	}
 	fuse_argc--;
 	fuse_argv[fuse_argc] = NULL;
@@ -773,7 +1190,7 @@ int main(int argc, char **argv)
 	list_deinit(args);
 
 	errno = EXIT_SUCCESS;
-	switch (stegfs_init(fs, paranoid, cipher, mode, hash, mac, kdf_iters, duplicates, show_bloc))
+	switch (stegfs_init(fs, paranoid, cipher, mode, hash, mac, kdf_iters, duplicates, show_bloc, async_copies, flush_threads, read_only))
 	{
 		case STEGFS_INIT_OKAY:
 			goto done;
@@ -197,7 +197,7 @@ static gcry_cipher_hd_t crypto_init(enum gcry_cipher_algos c, enum gcry_cipher_m
 	return cipher_handle;
 }
 
-static void superblock_info(stegfs_block_s *sb, const char *cipher, const char *mode, const char *hash, const char *mac, uint8_t copies, uint64_t kdf)
+static void superblock_info(stegfs_block_s *sb, const char *cipher, const char *mode, const char *hash, const char *mac, uint8_t copies, uint64_t kdf, uint32_t blocksize, bool indexed, uint8_t stripe, bool merkle, bool compress)
 {
 	tlv_t tlv = tlv_init();
 
@@ -205,12 +205,12 @@ static void superblock_info(stegfs_block_s *sb, const char *cipher, const char *
 	tlv_append(tlv, t);
 
 	t.tag = TAG_VERSION;
-	t.length = strlen(STEGFS_VERSION);
-	t.value = (byte_t *)STEGFS_VERSION;
+	t.length = strlen(STEGFS_FORMAT);
+	t.value = (byte_t *)STEGFS_FORMAT;
 	tlv_append(tlv, t);
 
 	t.tag = TAG_BLOCKSIZE;
-	uint32_t blocksize = htonl(SIZE_BYTE_BLOCK);
+	blocksize = htonl(blocksize);
 	t.length = sizeof blocksize;
 	t.value = m_malloc(sizeof blocksize);
 	memcpy(t.value, &blocksize, sizeof blocksize);
@@ -260,6 +260,38 @@ static void superblock_info(stegfs_block_s *sb, const char *cipher, const char *
 	tlv_append(tlv, t);
 	free(t.value);
 
+	if (indexed)
+	{
+		t.tag = TAG_INDEX;
+		t.length = sizeof indexed;
+		t.value = (byte_t *)&indexed;
+		tlv_append(tlv, t);
+	}
+
+	if (stripe)
+	{
+		t.tag = TAG_ERASURE;
+		t.length = sizeof stripe;
+		t.value = (byte_t *)&stripe;
+		tlv_append(tlv, t);
+	}
+
+	if (merkle)
+	{
+		t.tag = TAG_MERKLE;
+		t.length = sizeof merkle;
+		t.value = (byte_t *)&merkle;
+		tlv_append(tlv, t);
+	}
+
+	if (compress)
+	{
+		t.tag = TAG_COMPRESS;
+		t.length = sizeof compress;
+		t.value = (byte_t *)&compress;
+		tlv_append(tlv, t);
+	}
+
 	uint64_t tags = htonll(tlv_size(tlv));
 	memcpy(sb->data, &tags, sizeof tags);
 	memcpy(sb->data + sizeof tags, tlv_export(tlv), tlv_length(tlv));
@@ -282,6 +314,11 @@ int main(int argc, char **argv)
 	list_add(args, &((config_named_s){ 'f', "force",          NULL,            _("Force overwrite existing file, required when overwriting a file system in a normal file"), { CONFIG_ARG_REQ_BOOLEAN, { .boolean = false } }, false, true,  false, false }));
 	list_add(args, &((config_named_s){ 'r', "rewrite-sb",     NULL,            _("Rewrite the superblock (perhaps it became corrupt)"),                                      { CONFIG_ARG_REQ_BOOLEAN, { .boolean = false } }, false, true,  false, false }));
 	list_add(args, &((config_named_s){ 'd', "dry-run",        NULL,            _("Dry run - print details about the file system that would have been created"),              { CONFIG_ARG_REQ_BOOLEAN, { .boolean = false } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'n', "index",          NULL,            _("List the blocks of each file in index blocks, instead of chaining them together"),        { CONFIG_ARG_REQ_BOOLEAN, { .boolean = false } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'b', "block-size",     _("bytes"),      _("Size of each block; a power of 2 from 2,048 (the default) to 65,536"),                     { CONFIG_ARG_REQ_INTEGER, { .integer = 0     } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'e', "erasure",        "#",             _("Spread each file across # copies, using the rest for parity, instead of copying it whole"), { CONFIG_ARG_REQ_INTEGER, { .integer = 0     } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 't', "tree",           NULL,            _("Keep a hash tree of each file’s blocks in its index, so that blocks can be checked (and rewritten) on their own"), { CONFIG_ARG_REQ_BOOLEAN, { .boolean = false } }, false, false, false, false }));
+	list_add(args, &((config_named_s){ 'Z', "compress",       NULL,            _("Compress files before they’re encrypted, so that those which compress take fewer blocks"), { CONFIG_ARG_REQ_BOOLEAN, { .boolean = false } }, false, false, false, false }));
 
 	list_t extra = list_default();
 	list_add(extra, &((config_unnamed_s){ "device", { CONFIG_ARG_STRING,  { 0x0 } }, true,  false }));
@@ -316,6 +353,11 @@ int main(int argc, char **argv)
 	bool force      = ((config_named_s *)list_get(args,  8))->response.value.boolean;
 	bool rewrite    = ((config_named_s *)list_get(args,  9))->response.value.boolean;
 	bool dry_run    = ((config_named_s *)list_get(args, 10))->response.value.boolean;
+	bool indexed    = ((config_named_s *)list_get(args, 11))->response.value.boolean;
+	uint32_t blocksize = (uint32_t)((config_named_s *)list_get(args, 12))->response.value.integer ? : SIZE_BYTE_BLOCK;
+	uint32_t stripe = (uint32_t)((config_named_s *)list_get(args, 13))->response.value.integer;
+	bool merkle     = ((config_named_s *)list_get(args, 14))->response.value.boolean;
+	bool compress   = ((config_named_s *)list_get(args, 15))->response.value.boolean;
 
 	list_deinit(args);
 
@@ -337,6 +379,11 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Unknown cipher mode \"%s\"\n", m);
 		return EXIT_FAILURE;
 	}
+	if (MODE_SEALED(mode) && !MODE_SEALS(mode, cipher))
+	{
+		fprintf(stderr, "Cipher mode \"%s\" can’t be used with cipher \"%s\"\n", mode_name_from_id(mode), cipher_name_from_id(cipher));
+		return EXIT_FAILURE;
+	}
 	enum gcry_mac_algos mac = a ? mac_id_from_name(a) : DEFAULT_MAC;
 	if (mac == GCRY_MAC_NONE)
 	{
@@ -345,6 +392,50 @@ int main(int argc, char **argv)
 	}
 	if (!kdf)
 		kdf = DEFAULT_KDF_ITERATIONS;
+	if (blocksize < SIZE_BYTE_BLOCK || blocksize > SIZE_BYTE_BLOCK_MAX || blocksize & (blocksize - 1))
+	{
+		fprintf(stderr, "Invalid block size \"%" PRIu32 "\"\n", blocksize);
+		return EXIT_FAILURE;
+	}
+	/* without a superblock there’s nowhere to say that blocks aren’t the default size */
+	if (paranoid && blocksize != SIZE_BYTE_BLOCK)
+	{
+		fprintf(stderr, "Block size can’t be changed in paranoia mode\n");
+		return EXIT_FAILURE;
+	}
+	/* there must be a copy left over for parity (and a superblock to say so) */
+	if (stripe && stripe >= copies)
+	{
+		fprintf(stderr, "Erasure coding needs fewer than %" PRIu32 " copies of data\n", copies);
+		return EXIT_FAILURE;
+	}
+	if (paranoid && stripe)
+	{
+		fprintf(stderr, "Erasure coding can’t be used in paranoia mode\n");
+		return EXIT_FAILURE;
+	}
+	/* the tree is kept in the index, and is of whole copies of the file */
+	if (merkle && !indexed)
+	{
+		fprintf(stderr, "A hash tree needs an index (--index) to be kept in\n");
+		return EXIT_FAILURE;
+	}
+	if (merkle && stripe)
+	{
+		fprintf(stderr, "A hash tree can’t be used with erasure coding\n");
+		return EXIT_FAILURE;
+	}
+	if (paranoid && merkle)
+	{
+		fprintf(stderr, "A hash tree can’t be used in paranoia mode\n");
+		return EXIT_FAILURE;
+	}
+	/* (whether a file is compressed is in its inode, which has room to say so only since the superblock has) */
+	if (paranoid && compress)
+	{
+		fprintf(stderr, "Compression can’t be used in paranoia mode\n");
+		return EXIT_FAILURE;
+	}
 	if (c)
 		free(c);
 	if (h)
@@ -366,7 +457,7 @@ int main(int argc, char **argv)
 	if (s)
 		free(s);
 
-	uint64_t blocks = size / SIZE_BYTE_BLOCK;
+	uint64_t blocks = size / blocksize;
 	void *mm = NULL;
 	if (dry_run)
 		printf("Test run     : File system not modified\n");
@@ -402,7 +493,7 @@ int main(int argc, char **argv)
 	s2 = strchr(s1, '.');
 	l = s2 - s1;
 	printf("Size         : %'*.*g %s\n", r, (l + 2), z, units);
-	if ((z = ((double)size / SIZE_BYTE_BLOCK * SIZE_BYTE_DATA) / MEGABYTE) < 1)
+	if ((z = ((double)size / blocksize * SIZE_BYTE_DATA_IN(blocksize)) / MEGABYTE) < 1)
 	{
 		z *= KILOBYTE;
 		strcpy(units, "KB");
@@ -414,12 +505,20 @@ int main(int argc, char **argv)
 	s2 = strchr(s1, '.');
 	l = s2 - s1;
 	printf("Capacity     : %'*.*g %s\n", r, (l + 2), z, units);
-	printf("Largest file : %'*.*g %s\n", r, (l + 2), z / copies, units);
+	printf("Largest file : %'*.*g %s\n", r, (l + 2), z * (stripe ? : 1) / copies, units);
 	printf("Duplication  : %*d ×\n", rewrite ? 0 : r, copies);
+	printf("Block size   : %'*" PRIu32 "\n", r, blocksize);
 	printf("Cipher       : %s\n", cipher_name_from_id(cipher));
 	printf("Cipher mode  : %s\n", mode_name_from_id(mode));
 	printf("Hash         : %s\n", hash_name_from_id(hash));
 	printf("MAC          : %s\n", mac_name_from_id(mac));
+	printf("Block index  : %s\n", indexed ? "Yes" : "No");
+	if (stripe)
+		printf("Erasure code : %" PRIu32 " of %" PRIu32 "\n", stripe, copies);
+	else
+		printf("Erasure code : No\n");
+	printf("Hash tree    : %s\n", merkle ? "Yes" : "No");
+	printf("Compression  : %s\n", compress ? "Yes" : "No");
 
 	if (rewrite || dry_run)
 		goto superblock;
@@ -431,7 +530,8 @@ int main(int argc, char **argv)
 	gcry_create_nonce(rnd, sizeof rnd);
 #endif
 
-	gcry_cipher_hd_t gc = crypto_init(cipher, mode);
+	/* (a sealing mode is only a stream cipher without its tags) */
+	gcry_cipher_hd_t gc = crypto_init(cipher, MODE_SEALED(mode) ? (mode == GCRY_CIPHER_MODE_POLY1305 ? GCRY_CIPHER_MODE_STREAM : GCRY_CIPHER_MODE_CTR) : mode);
 	printf("\e[?25l"); /* hide cursor */
 	for (uint64_t i = 0; i < size / MEGABYTE; i++)
 	{
@@ -462,7 +562,7 @@ superblock:
 	sb.path[0] = htonll(PATH_MAGIC_0);
 	sb.path[1] = htonll(PATH_MAGIC_1);
 
-	superblock_info(&sb, cipher_name_from_id(cipher), mode_name_from_id(mode), hash_name_from_id(hash), mac_name_from_id(mac), copies, kdf);
+	superblock_info(&sb, cipher_name_from_id(cipher), mode_name_from_id(mode), hash_name_from_id(hash), mac_name_from_id(mac), copies, kdf, blocksize, indexed, stripe, merkle, compress);
 
 	sb.hash[0] = htonll(HASH_MAGIC_0);
 	sb.hash[1] = htonll(HASH_MAGIC_1);
@@ -24,12 +24,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <syslog.h>
 
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 
 #include <gcrypt.h>
+#include <zstd.h>
 
 /* submodule includes */
 
@@ -45,38 +49,411 @@
 
 
 #define normalize(I) ((I)%(file_system.size/file_system.blocksize))
+#define data_length() ((size_t)SIZE_BYTE_DATA_IN(file_system.blocksize))
+#define head_length() ((size_t)(data_length() - file_system.head_offset))
+#define block_tweaks() (file_system.version >= VERSION_2026_10)
+/* copies of a file (which, unless set for it, are the file system’s) and where, after its MAC, the inode says how many */
+#define file_copies(f) ((f)->copies ? (f)->copies : file_system.copies)
+#define inode_copies() ((file_system.copies + 1) * sizeof( uint64_t ) + gcry_mac_get_algo_maclen(file_system.mac))
+/* whether a file is compressed (then its size before it was) follows, if files can be; blocks hold the data as stored */
+#define inode_compress() (inode_copies() + 1)
+#define stored_data(f) ((f)->compressed ? &(f)->packed : &(f)->data)
+#define stored_size(f) ((f)->compressed ? (f)->stored : (f)->size)
+/* room for a block, whatever size they are, as 64 bit words (so that its parts line up) */
+#define block_words() (file_system.blocksize / sizeof( uint64_t ))
+/* blocks listed in each index block, index blocks needed to list a copy’s blocks, and where they are in its cipher stream */
+#define index_entries() (data_length() / sizeof( uint64_t ))
+#define list_blocks(b) (((b) + index_entries() - 1) / index_entries())
+#define index_blocks(b) (list_blocks(b) + tree_blocks(b))
+/* size of each node of a file’s hash tree, and the index blocks (after those listing its blocks) the tree takes */
+#define node_length() ((size_t)gcry_md_get_algo_dlen(file_system.hash))
+#define tree_blocks(b) (file_system.merkle ? (tree_nodes(b) * node_length() + data_length() - 1) / data_length() : 0)
+#define index_tweak(k) ((k) | 0x8000000000000000llu)
+#ifndef __DEBUG__
+#define block_sealed() (block_tweaks() && MODE_SEALED(file_system.mode))
+#else
+#define block_sealed() false
+#endif
+/* how much of a block’s path is the hash of its file’s; where blocks are encrypted on their own (and not sealed) the end of it is their salt */
+#define path_length() (block_tweaks() && !block_sealed() && gcry_md_get_algo_dlen(file_system.hash) > SIZE_BYTE_PATH - SIZE_BYTE_SALT ? SIZE_BYTE_PATH - SIZE_BYTE_SALT : gcry_md_get_algo_dlen(file_system.hash))
+/* a sealed copy’s MAC is of its tags, unless striped (when a file is rebuilt from more than one chain) or of a tree */
+#define mac_tags() (block_sealed() && !file_system.stripe && !file_system.merkle)
+/* the stripe (the block of each chain) a block of file data is in, and the first block of data in a stripe */
+#define data_stripe(c) (file_system.stripe && (c) ? ((c) - 1) / file_system.stripe + 1 : (c))
+#define stripe_data(s) (file_system.stripe && (s) ? ((s) - 1) * file_system.stripe + 1 : (s))
+
+
+/*
+ * a block, laid out in memory just as it is in the file system, with
+ * where each of its parts are; as the size of a block is only known
+ * once the file system is open, its parts are found at runtime
+ */
+typedef struct
+{
+	uint64_t *path;
+	uint8_t  *data;
+	uint64_t *hash;
+	uint64_t *next;
+}
+block_s;
+
+/*
+ * the MAC of a file’s data; an HMAC is calculated with a message digest
+ * handle as (unlike a MAC handle) its state can be copied, and so saved
+ * part way through
+ */
+typedef struct
+{
+	gcry_mac_hd_t mac;  /* when the MAC isn’t an HMAC */
+	gcry_md_hd_t  hmac; /* when it is */
+}
+file_mac_s;
+
+/*
+ * the copies of a file (all but the first) still to be written in the
+ * background; the file is a snapshot of the one that was written, as
+ * that may change or be closed before the copies are done
+ */
+typedef struct replica_s
+{
+	stegfs_file_s     file;              /* snapshot of the file */
+	unsigned          first;             /* first copy to write (those before it already have been) */
+	uint64_t          start[COPIES_MAX]; /* first block of each copy to write */
+	uint64_t          stop[COPIES_MAX];  /* and the last */
+	bool              reindex[COPIES_MAX]; /* whether its index needs writing too */
+	uint64_t         *inode;             /* inode (before encryption) which is the same for every copy */
+	uint64_t          bytes;             /* memory held by the snapshot */
+	struct replica_s *next;
+}
+replica_s;
+
+/*
+ * a closed file waiting to be written in the background; unlike the
+ * copies above this is the file from the cache itself, which nothing
+ * else touches until it has been written (every operation on a file
+ * waits for it first, see stegfs_file_wait)
+ */
+typedef struct flush_s
+{
+	stegfs_file_s  *file;
+	struct flush_s *next;
+}
+flush_s;
+
+/*
+ * a keystream, one for each thread, for random data that doesn’t need
+ * to come from the (much slower, and locked) nonce generator: padding,
+ * and the data written over deleted blocks
+ */
+typedef struct
+{
+	gcry_cipher_hd_t cipher;
+	uint64_t         left;   /* bytes until it needs a new key */
+}
+random_s;
+
+/*
+ * 16 bytes of a stripe, worked on at once (GCC turns the shuffles below
+ * into single byte-shuffle instructions where the target has them)
+ */
+typedef uint8_t gf_vector_t __attribute__((vector_size(16)));
+
+/*
+ * a run of nodes of one level of a file’s hash tree (the leaves being
+ * level 0) to be hashed, by a thread of its own if there are enough
+ */
+typedef struct
+{
+	const stegfs_file_s *file;
+	unsigned             level;
+	uint64_t             first; /* first node of the run */
+	uint64_t             last;  /* and the one after its last */
+}
+tree_s;
+
+/*
+ * a run of copies of a file to be written (see copies_write), by a
+ * thread of their own if there are enough blocks to write
+ */
+typedef struct
+{
+	const stegfs_file_s *file;
+	unsigned             first;   /* first copy of the run */
+	unsigned             last;    /* and the one after its last */
+	const uint64_t      *start;
+	const uint64_t      *stop;
+	const bool          *reindex;
+	const block_s       *inode;
+	bool                 written;
+}
+copies_s;
+
+/*
+ * secure memory, one arena for each thread, for the digests, keys and
+ * IVs needed while a block is read or written; taken and given back in
+ * order, so nothing else is needed to keep track of it
+ */
+typedef struct
+{
+	uint8_t *base;
+	size_t   used;
+}
+scratch_s;
 
 
 static version_e parse_version(const char *v);
 
-static bool block_read(uint64_t, stegfs_block_s *, gcry_cipher_hd_t, const char * const restrict);
-static bool block_write(uint64_t, stegfs_block_s, gcry_cipher_hd_t, const char * const restrict);
+static void file_locate(stegfs_file_s *, bool *);
+static bool file_chain(stegfs_file_s *, uint64_t);
+static bool file_index(stegfs_file_s *, uint64_t);
+static bool index_read(stegfs_file_s *, unsigned, uint64_t, gcry_cipher_hd_t);
+static bool index_write(const stegfs_file_s * const restrict, unsigned, gcry_cipher_hd_t, const uint8_t *, bool);
+static void file_unreserve(stegfs_file_s *);
+static bool file_head(stegfs_file_s *, uint8_t *);
+static bool file_load(stegfs_file_s *, uint64_t, uint64_t);
+static bool file_stripes(stegfs_file_s *, const uint8_t *);
+static bool stripes_complete(const stegfs_file_s * const restrict, unsigned);
+
+static uint64_t data_locate(uint64_t, size_t *, size_t *);
+static uint64_t data_blocks(uint64_t);
+static uint64_t chain_blocks(uint64_t);
+static void data_read(const stegfs_data_s * const restrict, void *, size_t, uint64_t);
+static void data_write(stegfs_data_s *, const void *, size_t, uint64_t);
+static void data_truncate(stegfs_data_s *, uint64_t);
+static void data_copy(stegfs_data_s *, const stegfs_data_s * const restrict);
+static size_t frame_pack(const stegfs_file_s * const restrict, uint64_t, uint8_t *, uint8_t *);
+static uint64_t file_pack(stegfs_file_s *, uint64_t);
+static bool file_unpack(stegfs_file_s *);
+
+static void gf_init(void);
+static uint8_t gf_mul(uint8_t, uint8_t);
+static uint8_t gf_inv(uint8_t);
+static void gf_madd(uint8_t *, const uint8_t *, uint8_t, size_t);
+static uint8_t stripe_coefficient(unsigned, unsigned);
+static void stripe_encode(const stegfs_file_s * const restrict, uint64_t, uint8_t *, unsigned);
+static bool stripe_decode(uint8_t *, const bool *, unsigned);
+
+static uint64_t tree_nodes(uint64_t);
+static uint64_t tree_level(uint64_t, unsigned, uint64_t *);
+static void tree_leaf(uint64_t, const uint8_t *, uint8_t *);
+static void tree_node(const uint8_t *, const uint8_t *, uint8_t *);
+static void tree_hash(const stegfs_file_s * const restrict, unsigned, uint64_t, uint64_t);
+static void *tree_worker(void *);
+static void tree_update(stegfs_file_s *, uint64_t, uint64_t);
+static bool tree_changed(const stegfs_file_s * const restrict, uint64_t);
+static bool tree_check(const stegfs_file_s * const restrict, uint64_t, const uint8_t *);
+static file_mac_s tree_mac(const stegfs_file_s * const restrict);
+static bool tree_verify(const stegfs_file_s * const restrict, const uint8_t *);
+static bool tree_load(stegfs_file_s *, uint64_t, uint64_t);
+
+static block_s block_parts(uint64_t *);
+static bool block_read(uint64_t, const block_s * const restrict, gcry_cipher_hd_t, const char * const restrict);
+static void block_path(const block_s * const restrict, const uint8_t *);
+static void block_hash(const block_s * const restrict);
+static bool block_encrypt(uint64_t, const block_s * const restrict, gcry_cipher_hd_t);
+static const uint8_t *block_tag(uint64_t);
 static void block_delete(uint64_t);
+static void block_shred(uint64_t);
+static void block_release(uint64_t);
+static void block_mark(uint64_t, const stegfs_file_s * const restrict);
+static void block_prefetch(uint64_t);
+static void blocks_prefetch(const uint64_t *, uint64_t, uint64_t);
 
 static bool block_in_use(uint64_t, const char * const restrict);
 static uint64_t block_assign(const char * const restrict);
 
 static gcry_cipher_hd_t init_cipher(const stegfs_file_s * const restrict, uint8_t);
+static void cipher_restart(gcry_cipher_hd_t, const stegfs_file_s * const restrict, uint8_t);
+static void cipher_seek(gcry_cipher_hd_t, const stegfs_file_s * const restrict, uint8_t, uint64_t);
+static void cipher_salt(gcry_cipher_hd_t, const uint8_t *);
+static void mac_key(const stegfs_file_s * const restrict, uint8_t *, size_t);
 static gcry_mac_hd_t init_mac(const stegfs_file_s * const restrict, uint8_t);
+static enum gcry_md_algos hmac_algo(void);
+
+static file_mac_s file_mac_open(const stegfs_file_s * const restrict, uint64_t *);
+static void file_mac_write(file_mac_s *, const void *, size_t);
+static void file_mac_save(file_mac_s *, stegfs_file_s *, uint64_t);
+static void file_mac_read(file_mac_s *, uint8_t *, size_t *);
+static bool file_mac_verify(file_mac_s *, const uint8_t *, size_t);
+static void file_mac_close(file_mac_s *);
+static void file_mac_tags(const stegfs_file_s * const restrict, unsigned, uint8_t *);
+static bool cipher_resumable(void);
+static bool cipher_resume(gcry_cipher_hd_t, const stegfs_file_s * const restrict, uint8_t, uint64_t);
+
+static bool copies_write(const stegfs_file_s * const restrict, unsigned, unsigned, const uint64_t *, const uint64_t *, const bool *, const block_s * const restrict);
+static bool copies_spread(const stegfs_file_s * const restrict, unsigned, unsigned, const uint64_t *, const uint64_t *, const bool *, const block_s * const restrict);
+static void *copies_worker(void *);
+static bool replica_queue(const stegfs_file_s * const restrict, unsigned, const uint64_t *, const uint64_t *, const bool *, const block_s * const restrict);
+static bool replica_pending(const stegfs_file_s * const restrict);
+static void replica_wait(const stegfs_file_s * const restrict);
+static void replica_free(replica_s *);
+static void *replica_worker(void *);
+
+static bool flush_queue(stegfs_file_s *);
+static void *flush_worker(void *);
+static void file_forget(stegfs_file_s *);
+static void file_free(stegfs_file_s *);
+static bool file_inode(const stegfs_file_s * const restrict, uint64_t);
+static bool file_known(stegfs_file_s *, const stegfs_file_s * const restrict);
+
+static void random_fill(void *, size_t);
+static void random_free(void *);
+static void *scratch_take(size_t);
+static void scratch_give(void *);
+static void scratch_free(void *);
+static void thread_init(void);
+
+static bool shred_queue(uint64_t);
+static int shred_compare(const void *, const void *);
+static void *shred_worker(void *);
+
+static void cache_link(stegfs_cache_s *, stegfs_cache_s *);
 
 
 static stegfs_s file_system;
 
-extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid, enum gcry_cipher_algos cipher, enum gcry_cipher_modes mode, enum gcry_md_algos hash, enum gcry_mac_algos mac, uint64_t kdf, uint32_t dups, bool show_bloc)
+/*
+ * GF(2^8) exponents (twice over, so that the sum of two logs needs no
+ * reduction) and logs, for the Reed-Solomon parity of striped files
+ */
+static uint8_t gf_exp[0x200];
+static uint8_t gf_log[0x100];
+
+/*
+ * queue of copies waiting to be written in the background, and the
+ * thread writing them (started when it’s first needed, as FUSE forks
+ * after the file system is initialised)
+ */
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;    /* signalled whenever a job is queued or done */
+	pthread_t       worker;
+	bool            running;
+	bool            stop;
+	replica_s      *head;
+	replica_s      *tail;
+	replica_s      *busy;    /* the job being written */
+	uint64_t        bytes;   /* memory held by queued jobs */
+}
+replicas = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, false, false, NULL, NULL, NULL, 0 };
+
+/*
+ * queue of closed files waiting to be written in the background, and the
+ * threads writing them (also started when first needed)
+ */
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;    /* signalled whenever a file is queued or written */
+	pthread_t      *workers;
+	unsigned        running;
+	bool            stop;
+	flush_s        *head;
+	flush_s        *tail;
+}
+flushes = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, false, NULL, NULL };
+
+/*
+ * deleted blocks waiting to be overwritten with random data, and the
+ * thread overwriting them (started when first needed)
+ */
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;    /* signalled whenever a block is queued */
+	pthread_t       worker;
+	bool            running;
+	bool            stop;
+	uint64_t       *blocks;
+	size_t          count;
+	size_t          size;    /* allocated length of blocks */
+}
+shreds = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, false, false, NULL, 0, 0 };
+
+/*
+ * arrays of cache entries outgrown whilst read-only; as the cache is then
+ * searched without the lock, someone might still be looking through one,
+ * so they’re kept until unmount
+ */
+static struct
+{
+	stegfs_cache_s ***arrays;
+	size_t            count;
+}
+retired = { NULL, 0 };
+
+/*
+ * page faults taken before the file system was mounted, so those while
+ * it was can be logged at unmount (by the same process; FUSE may have
+ * forked since, and a child starts counting from 0)
+ */
+static struct
+{
+	pid_t    pid;
+	uint64_t major;
+	uint64_t minor;
+}
+faults = { 0, 0, 0 };
+
+static size_t page_size;
+
+/*
+ * the in-use block tracker and the cache are shared by every thread
+ * writing files (the cache functions call each other, and themselves)
+ */
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static pthread_key_t random_key;
+static pthread_key_t scratch_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid, enum gcry_cipher_algos cipher, enum gcry_cipher_modes mode, enum gcry_md_algos hash, enum gcry_mac_algos mac, uint64_t kdf, uint32_t dups, bool show_bloc, bool async_copies, uint32_t flush_threads, bool read_only)
 {
-	if ((file_system.handle = open(fs, O_RDWR, S_IRUSR | S_IWUSR)) < 0)
+	if ((file_system.handle = open(fs, read_only ? O_RDONLY : O_RDWR, S_IRUSR | S_IWUSR)) < 0)
 		return STEGFS_INIT_UNKNOWN;
-	lockf(file_system.handle, F_LOCK, 0);
+	/*
+	 * a read-only mount shares its lock with any others, so the same
+	 * file system can be read more than once, but not while it’s being
+	 * written (nor written while it’s being read)
+	 */
+	struct flock lock = { .l_type = read_only ? F_RDLCK : F_WRLCK, .l_whence = SEEK_SET };
+	fcntl(file_system.handle, F_SETLKW, &lock);
 	file_system.size = lseek(file_system.handle, 0, SEEK_END);
-	if ((file_system.memory = mmap(NULL, file_system.size, PROT_READ | PROT_WRITE, MAP_SHARED, file_system.handle, 0)) == MAP_FAILED)
+	if ((file_system.memory = mmap(NULL, file_system.size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, file_system.handle, 0)) == MAP_FAILED)
 		return STEGFS_INIT_UNKNOWN;
+	/*
+	 * blocks are scattered at random, so reading ahead only wastes time
+	 * on blocks which aren’t wanted; those which are get asked for as
+	 * soon as they’re known (see block_prefetch)
+	 */
+	madvise(file_system.memory, file_system.size, MADV_RANDOM);
+	page_size = sysconf(_SC_PAGESIZE);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	faults.pid = getpid();
+	faults.major = usage.ru_majflt;
+	faults.minor = usage.ru_minflt;
+	file_system.read_only = read_only;
 
 	file_system.cache.name = m_strdup(DIR_SEPARATOR);
 	file_system.cache.ents = 0;
 	file_system.cache.child = NULL;
 	file_system.cache.file = NULL;
-	if ((file_system.show_bloc = show_bloc))
+	/* which file a block belongs to isn’t noted when read-only */
+	if ((file_system.show_bloc = show_bloc && !read_only))
 		stegfs_cache_add(PATH_BLOC, NULL);
+	file_system.async_copies = async_copies;
+	file_system.copies_pending = 0;
+	file_system.flush_threads = flush_threads;
+	file_system.flush_pending = 0;
+	file_system.flush_failed = 0;
+	file_system.shred_pending = 0;
+	file_system.indexed = false;
+	file_system.stripe = 0;
+	file_system.merkle = false;
+	file_system.compress = false;
 	if (paranoid)
 	{
 		file_system.cipher = cipher;
@@ -139,6 +516,7 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 	{
 		case VERSION_2015_08:
 		case VERSION_202X_XX:
+		case VERSION_2026_10:
 			file_system.version = version;
 			break;
 		default:
@@ -187,6 +565,8 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 		return STEGFS_INIT_INVALID_TAG;
 	if (file_system.version > VERSION_2015_08 && file_system.mac == GCRY_MAC_NONE)
 		return STEGFS_INIT_INVALID_TAG;
+	if (file_system.version >= VERSION_2026_10 && MODE_SEALED(file_system.mode) && !MODE_SEALS(file_system.mode, file_system.cipher))
+		return STEGFS_INIT_INVALID_TAG;
 
 	/* get number of copies */
 	if (tlv_has_tag(tlv, TAG_DUPLICATION))
@@ -201,6 +581,9 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 		return STEGFS_INIT_MISSING_TAG;
 	memcpy(&file_system.blocksize, tlv_value_of(tlv, TAG_BLOCKSIZE), tlv_length_of(tlv, TAG_BLOCKSIZE));
 	file_system.blocksize = ntohl(file_system.blocksize);
+	/* anything but the default only since blocks were encrypted on their own; a power of 2, so the parts of a block line up */
+	if (file_system.blocksize != SIZE_BYTE_BLOCK && (file_system.version < VERSION_2026_10 || file_system.blocksize < SIZE_BYTE_BLOCK || file_system.blocksize > SIZE_BYTE_BLOCK_MAX || file_system.blocksize & (file_system.blocksize - 1)))
+		return STEGFS_INIT_CORRUPT_TAG;
 
 	/* get number of bytes file data in file header */
 	if (!tlv_has_tag(tlv, TAG_HEADER_OFFSET))
@@ -218,10 +601,27 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 	else
 		file_system.kdf_iterations = DEFAULT_KDF_ITERATIONS;
 
+	/* whether files have an index; blocks must be encrypted on their own */
+	file_system.indexed = tlv_has_tag(tlv, TAG_INDEX) && *tlv_value_of(tlv, TAG_INDEX);
+	if (file_system.indexed && !block_tweaks())
+		return STEGFS_INIT_INVALID_TAG;
+	/* whether files are striped, with parity; again, blocks must be encrypted on their own */
+	if (tlv_has_tag(tlv, TAG_ERASURE))
+		file_system.stripe = *tlv_value_of(tlv, TAG_ERASURE);
+	if (file_system.stripe && (!block_tweaks() || file_system.stripe >= file_system.copies))
+		return STEGFS_INIT_INVALID_TAG;
+	/* whether files’ MACs are of a hash tree, which is kept in the index of every (whole) copy */
+	file_system.merkle = tlv_has_tag(tlv, TAG_MERKLE) && *tlv_value_of(tlv, TAG_MERKLE);
+	if (file_system.merkle && (!file_system.indexed || file_system.stripe))
+		return STEGFS_INIT_INVALID_TAG;
+	/* whether files are compressed; the inode says which are, where older inodes are random */
+	file_system.compress = tlv_has_tag(tlv, TAG_COMPRESS) && *tlv_value_of(tlv, TAG_COMPRESS);
+	if (file_system.compress && !block_tweaks())
+		return STEGFS_INIT_INVALID_TAG;
 
 	if (ntohll(block.next) != file_system.size / file_system.blocksize)
 		return STEGFS_INIT_CORRUPT_TAG;
-	if (file_system.head_offset > (ssize_t)file_system.blocksize)
+	if (file_system.head_offset > (ssize_t)data_length())
 		return STEGFS_INIT_CORRUPT_TAG;
 	if (file_system.copies <= 0 || file_system.copies > COPIES_MAX)
 		return STEGFS_INIT_INVALID_TAG;
@@ -231,8 +631,11 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 done:
 	file_system.blocks.used = 1;
 	file_system.blocks.in_use = m_calloc(file_system.size / file_system.blocksize, sizeof( bool ));
+	file_system.blocks.shred = m_calloc(file_system.size / file_system.blocksize, sizeof( bool ));
 	if (file_system.show_bloc)
 		file_system.blocks.file = m_calloc(file_system.size / file_system.blocksize, sizeof( char * ));
+	if (file_system.stripe)
+		gf_init();
 
 	init_crypto();
 	return STEGFS_INIT_OKAY;
@@ -246,6 +649,7 @@ static version_e parse_version(const char *v)
 		"2010.01", /* unsupported */
 		"2015.08",
 		"202X.XX",
+		"2026.10",
 		"Current"
 	};
 	for (version_e i = VERSION_CURRENT; i > VERSION_UNKNOWN; i--)
@@ -256,60 +660,139 @@ static version_e parse_version(const char *v)
 
 extern void stegfs_deinit(void)
 {
+	/*
+	 * let the closed files, then their background copies, and then the
+	 * shredding of deleted blocks (which either may add to) finish
+	 * before the memory goes away
+	 */
+	if (flushes.running)
+	{
+		pthread_mutex_lock(&flushes.mutex);
+		flushes.stop = true;
+		pthread_cond_broadcast(&flushes.cond);
+		pthread_mutex_unlock(&flushes.mutex);
+		for (unsigned i = 0; i < flushes.running; i++)
+			pthread_join(flushes.workers[i], NULL);
+		free(flushes.workers);
+		flushes.workers = NULL;
+		flushes.running = 0;
+		flushes.stop = false;
+	}
+	if (replicas.running)
+	{
+		pthread_mutex_lock(&replicas.mutex);
+		replicas.stop = true;
+		pthread_cond_broadcast(&replicas.cond);
+		pthread_mutex_unlock(&replicas.mutex);
+		pthread_join(replicas.worker, NULL);
+		replicas.running = false;
+		replicas.stop = false;
+	}
+	if (shreds.running)
+	{
+		pthread_mutex_lock(&shreds.mutex);
+		shreds.stop = true;
+		pthread_cond_broadcast(&shreds.cond);
+		pthread_mutex_unlock(&shreds.mutex);
+		pthread_join(shreds.worker, NULL);
+		shreds.running = false;
+		shreds.stop = false;
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	if (faults.pid != getpid())
+		faults.major = faults.minor = 0;
+	syslog(LOG_INFO, "%s: %ju major and %ju minor page faults whilst mounted", STEGFS_NAME, (uintmax_t)usage.ru_majflt - faults.major, (uintmax_t)usage.ru_minflt - faults.minor);
+
+	/* (the cache gives back blocks reserved for its files, so goes before the block maps) */
+	stegfs_cache_remove(DIR_SEPARATOR);
+	free(file_system.cache.name);
+	for (size_t i = 0; i < retired.count; i++)
+		free(retired.arrays[i]);
+	free(retired.arrays);
+	retired.arrays = NULL;
+	retired.count = 0;
+
 	//msync(file_system.memory, file_system.size,  MS_SYNC);
 	munmap(file_system.memory, file_system.size);
 	close(file_system.handle);
 
 	free(file_system.blocks.in_use);
+	free(file_system.blocks.shred);
 	if (file_system.show_bloc)
 	{
-		for (uint64_t i = 0; i < file_system.blocks.used; i++)
+		for (uint64_t i = 0; i < file_system.size / file_system.blocksize; i++)
 			if (file_system.blocks.file[i])
 				free(file_system.blocks.file[i]);
 		free(file_system.blocks.file);
 	}
 
-	stegfs_cache_remove(DIR_SEPARATOR);
-	free(file_system.cache.name);
-
 	return;
 }
 
 extern stegfs_s stegfs_info(void)
 {
-	return file_system;
+	stegfs_s info = file_system;
+	/* the root might be gaining entries (see cache_link) */
+	info.cache.ents = __atomic_load_n(&file_system.cache.ents, __ATOMIC_ACQUIRE);
+	info.cache.child = __atomic_load_n(&file_system.cache.child, __ATOMIC_ACQUIRE);
+	return info;
 }
 
-extern bool stegfs_file_will_fit(stegfs_file_s *file)
+extern bool stegfs_file_will_fit(stegfs_file_s *file, uint64_t size)
 {
-	stegfs_block_s block;
-	lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-	uint64_t blocks_needed = (d.quot + (d.rem > 0)) * file_system.copies;
-
+	if (file_system.read_only)
+		return errno = EROFS, false;
+	uint64_t blocks = chain_blocks(size);
 	uint64_t blocks_total = (file_system.size / file_system.blocksize) - 1;
-	if (blocks_needed > blocks_total)
-	{
-		stegfs_file_delete(file);
+	uint64_t index = file_system.indexed ? index_blocks(blocks) : 0;
+	if ((blocks + index) * file_copies(file) > blocks_total)
 		return errno = EFBIG, false; /* file would not fit in the file system */
-	}
-	if (blocks_needed > blocks_total - file_system.blocks.used)
-	{
-		stegfs_file_delete(file);
-		return errno = ENOSPC, false; /* file won’t fit in remaining space */
-	}
+	/*
+	 * blocks the file already has (or has reserved) are already used;
+	 * a new file also needs its inodes
+	 */
+	uint64_t blocks_needed = file->blocks[0] ? 0 : file_copies(file);
+	uint64_t blocks_held = file->blocks[0] ? file->blocks[0][0] : 0;
+	if (blocks > blocks_held)
+		blocks_needed += (blocks - blocks_held) * file_copies(file);
+	uint64_t index_held = file->index[0] ? file->index[0][0] : 0;
+	if (index > index_held)
+		blocks_needed += (index - index_held) * file_copies(file);
+	/* as do copies it didn’t have before */
+	for (unsigned i = 1; file->blocks[0] && i < file_copies(file); i++)
+		if (!file->blocks[i])
+			blocks_needed += 1 + blocks + index;
+	/* most of the time the space was reserved by an earlier write */
+	if (blocks_needed <= file->reserved)
+		return errno = EXIT_SUCCESS, true;
+	/*
+	 * reserve the rest against what’s free, allowing for space other
+	 * files have reserved but not yet written
+	 */
+	uint64_t extra = blocks_needed - file->reserved;
+	uint64_t reserved = __atomic_load_n(&file_system.blocks.reserved, __ATOMIC_RELAXED);
+	do
+		if (__atomic_load_n(&file_system.blocks.used, __ATOMIC_RELAXED) + reserved + extra > blocks_total)
+			return errno = ENOSPC, false; /* file won’t fit in remaining space */
+	while (!__atomic_compare_exchange_n(&file_system.blocks.reserved, &reserved, reserved + extra, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	file->reserved = blocks_needed;
 	return errno = EXIT_SUCCESS, true;
 }
 
 extern void stegfs_file_create(const char * const restrict path, bool write)
 {
 	stegfs_file_s file;
-	//memset(&file, 0x00, sizeof file);
+	memset(&file, 0x00, sizeof file);
 	file.path = dir_get_path(path);
 	file.name = dir_get_name(path, PASSWORD_SEPARATOR);
 	file.pass = dir_get_pass(path);
 	file.write = write;
 	file.size = 0;
+	file.dirty = 0;
 	file.time = time(NULL);
+	file.copies = stegfs_directory_copies(file.path);
 	stegfs_cache_add(NULL, &file);
 	return;
 }
@@ -321,6 +804,14 @@ extern void stegfs_directory_create(const char * const restrict path)
 
 extern bool stegfs_file_stat_aux(stegfs_file_s *file, bool quick)
 {
+	/* copies still being written can’t be checked */
+	replica_wait(file);
+	/* the hash tree (if there is one) is that of the first index read */
+	free(file->tree);
+	file->tree = NULL;
+	file->tree_leaves = 0;
+	/* as is the data as stored, if compressed */
+	data_truncate(&file->packed, 0);
 	/*
 	 * figure out where the files’ inode blocks are
 	 */
@@ -343,6 +834,9 @@ extern bool stegfs_file_stat_aux(stegfs_file_s *file, bool quick)
 		inodes[len] = b;
 	}
 	gcry_md_close(hash);
+	/* have every copy’s inode on its way in while the first is decrypted */
+	for (unsigned i = 0; i < file_system.copies; i++)
+		block_prefetch(file->inodes[i]);
 	/*
 	 * read file inode, pray for success, then see if we can get a
 	 * complete copy of the file
@@ -350,65 +844,86 @@ extern bool stegfs_file_stat_aux(stegfs_file_s *file, bool quick)
 	unsigned available_inodes = file_system.copies;
 	unsigned corrupt_copies = 0;
 	bool found = false;
-	for (unsigned i = 0; i < file_system.copies; i++)
+	/* how many copies there are isn’t known until an inode says */
+	unsigned copies = file_system.copies;
+	for (unsigned i = 0; i < copies; i++)
 	{
 		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		stegfs_block_s inode;
-		//memset(&inode, 0x00, sizeof inode);
+		uint64_t raw[block_words()];
+		block_s inode = block_parts(raw);
 		if (block_read(file->inodes[i], &inode, cipher_handle, file->path))
 		{
-			if ((file->size = ntohll(inode.next)) > file_system.size)
+			unsigned c = block_tweaks() ? inode.data[inode_copies()] : file_system.copies;
+			/* the blocks hold the data as stored; a compressed file also has the size it really is */
+			file->size = file->stored = ntohll(*inode.next);
+			if ((file->compressed = file_system.compress && inode.data[inode_compress()]))
+			{
+				memcpy(&file->size, inode.data + inode_compress() + 1, sizeof file->size);
+				file->size = ntohll(file->size);
+			}
+			if (file->stored > file_system.size || c <= file_system.stripe || c > file_system.copies || (found && c != copies))
 			{
 				available_inodes--;
 				gcry_cipher_close(cipher_handle);
 				continue;
 			}
-			file_system.blocks.in_use[normalize(file->inodes[i])] = true;
-			if (file_system.show_bloc)
-				m_asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-			file_system.blocks.used++;
+			block_mark(file->inodes[i], file);
 			if (!quick && found)
 				continue;
 
-			uint64_t first[SIZE_LONG_DATA];
-			memcpy(first, inode.data, sizeof first);
+			copies = c;
+			uint64_t first[COPIES_MAX + 1];
+			memcpy(first, inode.data, (file_system.copies + 1) * sizeof *first);
 			file->time = htonll(first[0]);
-			for (unsigned j = 0, l = 1; j < file_system.copies; j++, l++)
+			/* likewise the start of each copy’s index (or chain) */
+			for (unsigned j = 1; j <= copies; j++)
+				block_prefetch(htonll(first[j]));
+			for (unsigned j = 0, l = 1; j < copies; j++, l++)
 			{
 				gcry_cipher_hd_t another_cipher = init_cipher(file, j);
-				lldiv_t d = lldiv(file->size - (file->size < (sizeof inode.data - file_system.head_offset) ? file->size : (sizeof inode.data - file_system.head_offset)), SIZE_BYTE_DATA);
-				uint64_t blocks = d.quot + (d.rem > 0);
+				uint64_t blocks = chain_blocks(file->stored);
 				file->blocks[j] = m_realloc(file->blocks[j], (blocks + 2) * sizeof blocks);
-				//memset(file->blocks[j], 0x00, blocks * sizeof blocks);
+				memset(file->blocks[j], 0x00, (blocks + 2) * sizeof blocks);
 				file->blocks[j][0] = blocks;
+				/*
+				 * with an index, every block is known once the
+				 * (few) index blocks have been read
+				 */
+				if (file_system.indexed)
+				{
+					if (!index_read(file, j, htonll(first[l]), another_cipher))
+						corrupt_copies++;
+					gcry_cipher_close(another_cipher);
+					continue;
+				}
 				if (blocks)
 				{
 					/* first full block of file data */
 					file->blocks[j][1] = htonll(first[l]);
-					file_system.blocks.in_use[normalize(file->blocks[j][1])] = true;
-					if (file_system.show_bloc)
-						m_asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-					file_system.blocks.used++;
+					block_mark(file->blocks[j][1], file);
 				}
 				/*
 				 * traverse file block tree; whilst the
 				 * whole block is read, the actual file
 				 * data is discarded
 				 */
+				uint64_t block_raw[block_words()];
+				block_s block = block_parts(block_raw);
 				for (uint64_t k = 2 ; k <= blocks; k++)
 				{
-					stegfs_block_s block;
-					//memset(&block, 0x00, sizeof block);
+					cipher_seek(another_cipher, file, j, k - 1);
 					if (block_read(file->blocks[j][k - 1], &block, another_cipher, file->path))
 					{
-						file_system.blocks.in_use[normalize(file->blocks[j][k - 1])] = true;
-						if (file_system.show_bloc)
-							m_asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-						file_system.blocks.used++;
-						file->blocks[j][k] = ntohll(block.next);
+						block_mark(file->blocks[j][k - 1], file);
+						file->blocks[j][k] = ntohll(*block.next);
+						/* the last block has no next, but is still used */
+						if (k == blocks)
+							block_mark(file->blocks[j][k], file);
 					}
 					else
 					{
+						/* forget the rest of the chain (from the bad block) */
+						memset(file->blocks[j] + k - 1, 0x00, (blocks - k + 2) * sizeof blocks);
 						corrupt_copies++;
 						break;
 					}
@@ -417,7 +932,7 @@ extern bool stegfs_file_stat_aux(stegfs_file_s *file, bool quick)
 			}
 			if (quick)
 				break;
-			if (corrupt_copies < file_system.copies)
+			if (file_system.stripe ? stripes_complete(file, copies) : corrupt_copies < copies)
 				found = true;
 		}
 		else
@@ -425,84 +940,133 @@ extern bool stegfs_file_stat_aux(stegfs_file_s *file, bool quick)
 		gcry_cipher_close(cipher_handle);
 	}
 	/*
-	 * as long as there’s a valid inode and one complete copy we’re
-	 * good
+	 * as long as there’s a valid inode and one complete copy (or enough
+	 * of every stripe) we’re good
 	 */
-	if (available_inodes && corrupt_copies < file_system.copies)
+	if (available_inodes && (file_system.stripe ? stripes_complete(file, copies) : corrupt_copies < copies))
 	{
+		file->copies = copies;
+		/* (forgetting any copies it no longer has) */
+		for (unsigned i = copies; i < file_system.copies; i++)
+		{
+			free(file->blocks[i]);
+			file->blocks[i] = NULL;
+			free(file->index[i]);
+			file->index[i] = NULL;
+		}
 		stegfs_cache_add(NULL, file);
-		return true;
+		return errno = EXIT_SUCCESS, true;
 	}
 	for (unsigned i = 0; i < file_system.copies; i++)
+	{
 		if (file->blocks[i])
 		{
-			for (uint64_t j = 1; j < file->blocks[i][0]; j++)
-			{
-				file_system.blocks.in_use[normalize(file->blocks[i][j])] = false;
-				if (file_system.show_bloc)
-				{
-					free(file_system.blocks.file[normalize(file->blocks[i][j])]);
-					file_system.blocks.file[normalize(file->blocks[i][j])] = NULL;
-				}
-				file_system.blocks.used--;
-			}
+			for (uint64_t j = 1; j < file->blocks[i][0] && file->blocks[i][j]; j++)
+				block_release(file->blocks[i][j]);
 			free(file->blocks[i]);
 			file->blocks[i] = NULL;
 		}
+		if (file->index[i])
+		{
+			for (uint64_t j = 1; j <= file->index[i][0] && file->index[i][j]; j++)
+				block_release(file->index[i][j]);
+			free(file->index[i]);
+			file->index[i] = NULL;
+		}
+	}
+	free(file->tree);
+	file->tree = NULL;
+	file->tree_leaves = 0;
+	file->compressed = false;
 	return errno = ENOENT, false;
 }
 
 extern bool stegfs_file_read(stegfs_file_s *file)
 {
-	if (!stegfs_file_stat(file, true))
+	/*
+	 * if nothing has changed since the file was last read/written then
+	 * we already know where it is (and stat would forget any blocks
+	 * reserved for it)
+	 */
+	if ((file->dirty != UINT64_MAX || !file->blocks[0] || !file->inodes[0]) && !stegfs_file_stat(file, true))
 		return false;
 	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
-	uint8_t *mac_data = m_gcry_calloc_secure(mac_length, sizeof( uint8_t ));
+	uint8_t *mac_data = scratch_take(mac_length);
 	/*
 	 * read the start of the file data
 	 */
-	file->data = m_realloc(file->data, file->size);
-	for (unsigned i = 0, c = 0; i < file_system.copies && !c; i++)
-	{
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		stegfs_block_s inode;
-		//memset(&inode, 0x00, sizeof inode);
-		if (block_read(file->inodes[i], &inode, cipher_handle, file->path))
-		{
-			memcpy(file->data, inode.data + file_system.head_offset, file->size < (sizeof inode.data - file_system.head_offset) ? file->size : (sizeof inode.data - file_system.head_offset));
-			memcpy(mac_data, inode.data + ((file_system.copies + 1) * sizeof( uint64_t )), mac_length);
-			c = 1;
-		}
-		gcry_cipher_close(cipher_handle);
-	}
+	stegfs_data_truncate(file, 0);
+	data_truncate(&file->packed, 0);
+	file->unloaded = 0;
+	file_head(file, mac_data);
 	/*
-	 * and then the rest of it
+	 * and then the rest of it; a striped file is put back together from
+	 * whichever blocks of each stripe can be read, as there’s no whole
+	 * copy of it to try instead
 	 */
-	stegfs_block_s block;
-	for (unsigned i = 0, corrupt_copies = 0; i < file_system.copies; i++)
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	if (file_system.stripe && file_stripes(file, mac_data))
+		goto done;
+	/*
+	 * with a hash tree only its root need be checked now; each block
+	 * is checked against it when (and if) it’s loaded
+	 */
+	if (file_system.merkle && tree_verify(file, mac_data))
 	{
-		lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-		uint64_t blocks = d.quot + (d.rem > 0);
-		if (file->blocks[i][0] != blocks)
+		file->unloaded = data_blocks(stored_size(file));
+		goto done;
+	}
+	for (unsigned i = 0, corrupt_copies = 0; !file_system.stripe && !file_system.merkle && i < file_copies(file); i++)
+	{
+		/* the other copies might not have been written yet */
+		if (i == 1)
+			replica_wait(file);
+		uint64_t blocks = data_blocks(stored_size(file));
+		if (file->blocks[i][0] < blocks)
 			continue; /* this copy is corrupt; try the next */
+		blocks_prefetch(file->blocks[i], 1, blocks);
 		bool failed = false;
 		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		gcry_mac_hd_t mac_handle = init_mac(file, i);
-		for (uint64_t j = 1, k = 0; j <= file->blocks[i][0] && file->blocks[i][j]; j++, k++)
+		/*
+		 * every copy holds the same data, so shares the MAC of the
+		 * first, unless sealed, when the MAC is of the copy’s tags
+		 */
+		if (block_sealed())
+		{
+			block_s inode = block;
+			if (!block_read(file->inodes[i], &inode, cipher_handle, file->path))
+			{
+				gcry_cipher_close(cipher_handle);
+				corrupt_copies++;
+				continue;
+			}
+			memcpy(mac_data, inode.data + (file_system.copies + 1) * sizeof( uint64_t ), mac_length);
+		}
+		uint64_t m = 1;
+		file_mac_s mac = file_mac_open(file, &m);
+		for (uint64_t j = 1, k = 0; j <= blocks; j++, k++)
 		{
 			/*
 			 * we should be largely confident that we’ll be
 			 * able to read the complete file as otherwise the
 			 * stat would have failed
 			 */
-			//memset(&block, 0x00, sizeof block);
-			if (block_read(file->blocks[i][j], &block, cipher_handle, file->path))
+			cipher_seek(cipher_handle, file, i, j);
+			if (file->blocks[i][j] && block_read(file->blocks[i][j], &block, cipher_handle, file->path))
 			{
-				size_t l = sizeof block.data;
-				if ((l + k * sizeof block.data) > (file->size - (sizeof block.data - file_system.head_offset)))
-					l = l - ((l + k * sizeof block.data) - (file->size - (sizeof block.data - file_system.head_offset)));
-				memcpy(file->data + (sizeof block.data - file_system.head_offset) + k * sizeof block.data, block.data, l);
-				gcry_mac_write(mac_handle, block.data, sizeof block.data);
+				size_t l = data_length();
+				if ((l + k * data_length()) > (stored_size(file) - head_length()))
+					l = l - ((l + k * data_length()) - (stored_size(file) - head_length()));
+				data_write(stored_data(file), block.data, l, head_length() + k * data_length());
+				if (block_sealed())
+					file_mac_write(&mac, block.hash, SIZE_BYTE_TAG);
+				else
+				{
+					if (j == blocks)
+						file_mac_save(&mac, file, j - 1);
+					file_mac_write(&mac, block.data, data_length());
+				}
 			}
 			else
 			{
@@ -513,290 +1077,2782 @@ extern bool stegfs_file_read(stegfs_file_s *file)
 		}
 		gcry_cipher_close(cipher_handle);
 		/* compare generated MAC with stored MAC */
-		if (file_system.version >= VERSION_202X_XX && gcry_mac_verify(mac_handle, mac_data, mac_length) == GPG_ERR_CHECKSUM)
+		if (file_system.version >= VERSION_202X_XX && !failed && !file_mac_verify(&mac, mac_data, mac_length))
 			failed = true;
-		gcry_mac_close(mac_handle);
-		gcry_free(mac_data);
-		if (failed)
-			continue;
-		stegfs_cache_add(NULL, file);
-		return corrupt_copies < file_system.copies;
+		file_mac_close(&mac);
+		if (!failed)
+			goto done;
+	}
+	scratch_give(mac_data);
+	/* whatever MAC state was saved along the way can’t be trusted */
+	if (file->mac_state)
+	{
+		gcry_md_close(file->mac_state);
+		file->mac_state = NULL;
 	}
 	/*
 	 * somehow we failed to read a complete copy of the file, despite
 	 * knowing that a complete copy existed when stat’d
 	 */
 	return errno = EIO, false;
+done:
+	scratch_give(mac_data);
+	/* a compressed file is no use until all of it’s been read, and decompressed */
+	if (file->compressed && ((file->unloaded && !tree_load(file, 1, file->unloaded)) || !file_unpack(file)))
+		return errno = EIO, false;
+	file->dirty = UINT64_MAX;
+	file->dirty_end = 0;
+	stegfs_cache_add(NULL, file);
+	return errno = EXIT_SUCCESS, true;
 }
 
-extern bool stegfs_file_write(stegfs_file_s *file)
+extern bool stegfs_file_read_tail(stegfs_file_s *file)
 {
-	stegfs_block_s block;
-	lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-	uint64_t blocks = d.quot + (d.rem > 0);
-	uint64_t z = file->size;
-	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
-	uint8_t *mac_data = m_gcry_calloc_secure(mac_length, sizeof( uint8_t ));
+	uint64_t blocks = data_blocks(file->size);
+	/*
+	 * only worth it if the file hasn’t changed since it was last
+	 * read/written and the MAC can carry on from the start of its
+	 * last block (or isn’t of the data, as when sealed); otherwise
+	 * the whole file is needed to recalculate the MAC anyway
+	 */
+	if (file->dirty != UINT64_MAX || !file->blocks[0] || !file->inodes[0] || !blocks || (!mac_tags() && (!file->mac_state || file->mac_blocks + 1 != blocks)))
+		return stegfs_file_read(file);
+	/* the last block of a striped file can’t be had without the rest of its stripe, nor that of a compressed file without the rest of it */
+	if (file_system.stripe || file->compressed)
+		return stegfs_file_read(file);
+	stegfs_data_truncate(file, 0);
+	file->unloaded = 0;
+	if (!file_head(file, NULL) || !file_load(file, blocks, blocks))
+		return stegfs_file_read(file);
+	file->unloaded = blocks - 1;
+	return errno = EXIT_SUCCESS, true;
+}
 
-	if (!stegfs_file_stat(file, true))
+extern bool stegfs_file_load(stegfs_file_s *file, uint64_t offset, uint64_t size)
+{
+	/* the head (in the inode) and the last block are always loaded */
+	if (!file->unloaded || offset + size <= head_length() || offset >= head_length() + file->unloaded * data_length())
+		return true;
+	/* with a hash tree each block can be checked on its own, so only those in range are read */
+	if (file_system.merkle)
 	{
-		for (unsigned i = 0; i < file_system.copies; i++)
-		{
-			/*
-			 * allocate inodes, mark as in use (inode locations
-			 * are calculated in stegfs_file_stat)
-			 */
-			file_system.blocks.in_use[normalize(file->inodes[i])] = true;
-			if (file_system.show_bloc)
-				m_asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-			file_system.blocks.used++;
-			/*
-			 * note-to-self: allocate 2 more blocks than is
-			 * necessary so that block[0] indicates how many
-			 * blocks there are (needed) * and block[last] is
-			 * kept 0x00 as an “end of chain” guard
-			 */
-			file->blocks[i] = m_calloc(blocks + 2, sizeof blocks);
-			file->blocks[i][0] = blocks;
-			for (uint64_t j = 1; j <= blocks; j++)
-				if (!(file->blocks[i][j] = block_assign(file->path)))
-				{
-					/* failed to allocate space; free what we had claimed */
-					for (unsigned k = 0; k <= i; k++)
-					{
-						file_system.blocks.in_use[normalize(file->inodes[i])] = false;
-						if (file_system.show_bloc)
-						{
-							free(file_system.blocks.file[normalize(file->inodes[i])]);
-							file_system.blocks.file[normalize(file->inodes[i])] = NULL;
-						}
-						file_system.blocks.used--;
-						if (file->blocks[k])
-						{
-							for (uint64_t l = 1; l <= j; l++)
-							{
-								file_system.blocks.in_use[normalize(file->blocks[k][l])] = false;
-								if (file_system.show_bloc)
-								{
-									free(file_system.blocks.file[normalize(file->blocks[k][l])]);
-									file_system.blocks.file[normalize(file->blocks[k][l])] = NULL;
-								}
-								file_system.blocks.used--;
-							}
-							free(file->blocks[k]);
-							file->blocks[k] = NULL;
-						}
-					}
-					return errno = ENOSPC, false;
-				}
-				else if (file_system.show_bloc)
-					m_asprintf(&file_system.blocks.file[normalize(file->blocks[i][j])], "../%s/%s", file->path, file->name);
-		}
+		size_t within, length;
+		uint64_t first = offset < head_length() ? 1 : data_locate(offset, &within, &length);
+		uint64_t last = data_locate(offset + size - 1, &within, &length);
+		return tree_load(file, first, last < file->unloaded ? last : file->unloaded);
 	}
-	file->size = z; /* stat can cause size to be reset to 0 */
-	if (blocks > file->blocks[0][0]) /* need more blocks than we have */
+	if (!file_load(file, 1, file->unloaded))
+		return false;
+	file->unloaded = 0;
+	return true;
+}
+
+extern bool stegfs_file_write(stegfs_file_s *file)
+{
+	if (file_system.read_only)
+		return errno = EROFS, false;
+	/* nothing has changed since the file was last read/written */
+	if (file->dirty == UINT64_MAX && file->blocks[0])
+		return true;
+	/* the copies from last time have to be finished before they change */
+	replica_wait(file);
+	bool claimed[COPIES_MAX] = { false };
+	file_locate(file, claimed);
+	/*
+	 * when files can be compressed, what’s changed is compressed again
+	 * (which needs all of the file) and from then on it’s the data as
+	 * stored that’s written; where that changed is only known as far as
+	 * where it starts
+	 */
+	uint64_t dirty = file->dirty;
+	uint64_t dirty_end = file->dirty_end;
+	if (file_system.compress)
 	{
-		for (unsigned i = 0; i < file_system.copies; i++)
-		{
-			file->blocks[i] = m_realloc(file->blocks[i], (blocks + 2) * sizeof blocks);
-			for (uint64_t j = file->blocks[i][0]; j <= blocks; j++)
-				if (!(file->blocks[i][j] = block_assign(file->path)))
-				{
-					/* failed to allocate space; free what we had claimed */
-					for (unsigned k = 0; k <= i; k++)
-						for (uint64_t l = file->blocks[k][0]; l <= j; l++)
-						{
-							file_system.blocks.in_use[normalize(file->blocks[k][l])] = false;
-							if (file_system.show_bloc)
-							{
-								free(file_system.blocks.file[normalize(file->blocks[k][l])]);
-								file_system.blocks.file[normalize(file->blocks[k][l])] = NULL;
-							}
-							file_system.blocks.used--;
-						}
-					return errno = ENOSPC, false;
-				}
-				else if (file_system.show_bloc)
-					m_asprintf(&file_system.blocks.file[normalize(file->blocks[i][j])], "../%s/%s", file->path, file->name);
-		}
-		for (unsigned i = 0; i < file_system.copies; i++)
-			file->blocks[i][0] = blocks;
+		bool was = file->compressed;
+		if (!stegfs_file_load(file, 0, file->size))
+			return false;
+		dirty = file_pack(file, dirty);
+		if (was || file->compressed)
+			dirty_end = 0;
 	}
-	else if (blocks < file->blocks[0][0]) /* have more blocks than we need */
-		for (unsigned i = 0; i < file_system.copies; i++)
-		{
-			for (uint64_t j = blocks + 1; j <= file->blocks[i][0]; j++)
-				block_delete(file->blocks[i][j]);
-			file->blocks[i] = m_realloc(file->blocks[i], (blocks + 2) * sizeof blocks);
-			file->blocks[i][0] = blocks;
-		}
+
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	uint64_t blocks = chain_blocks(stored_size(file));
+	uint64_t chain = chain_blocks(stored_size(file) > file->allocated ? stored_size(file) : file->allocated);
+	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
+	uint8_t *mac_data = scratch_take(mac_length);
 	/*
-	 * write the data
+	 * figure out the first block that needs rewriting; everything
+	 * before it is unchanged, both on disk and in memory, as is the
+	 * cipher text that chains in to it (when striped, the whole stripe
+	 * that a changed block is in is written again, parity and all)
 	 */
-	for (unsigned i = 0; i < file_system.copies; i++)
+	size_t within, length;
+	uint64_t have = file->blocks[0][0];
+	uint64_t from = dirty ? data_stripe(data_locate(dirty - 1, &within, &length)) : 0;
+	if (have != chain && from > (have < chain ? have : chain))
+		from = have < chain ? have : chain; /* the old/new last block gets a new next pointer */
+	if (from < 1)
+		from = 1;
+	/*
+	 * when each block is encrypted on its own, the chain is the same
+	 * length, and it’s known where the changes end, nothing after that
+	 * needs writing either
+	 */
+	uint64_t to = blocks;
+	if (block_tweaks() && have == chain && dirty_end > dirty)
 	{
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		gcry_mac_hd_t mac_handle = init_mac(file, i);
-		for (uint64_t j = 1, k = 0; j <= blocks; j++, k++)
-		{
-			size_t l = sizeof block.data;
-			if ((l + k * sizeof block.data) > (file->size - (sizeof block.data - file_system.head_offset)))
-				l = l - ((l + k * sizeof block.data) - (file->size - (sizeof block.data - file_system.head_offset)));
-			gcry_create_nonce(&block, sizeof block);
-			memcpy(block.data, file->data + (sizeof block.data - file_system.head_offset) + k * sizeof block.data, l);
-			block.next = htonll(file->blocks[i][j + 1]);
-			if (!i)
-				gcry_mac_write(mac_handle, block.data, sizeof block.data);
-			if (!block_write(file->blocks[i][j], block, cipher_handle, file->path))
-			{
-				/* see below (where inode blocks are written) */
-				for (unsigned k = 0; k <= i; k++)
-					for (uint64_t l = 1; l <= j; l++)
-						block_delete(file->blocks[k][l]);
-				gcry_cipher_close(cipher_handle);
-				gcry_mac_close(mac_handle);
-				return false;
-			}
-		}
-		/* store the calculated MAC for read verification */
-		if (!i)
-			gcry_mac_read(mac_handle, mac_data, &mac_length);
-		gcry_mac_close(mac_handle);
-		gcry_cipher_close(cipher_handle);
+		to = data_stripe(data_locate(dirty_end - 1, &within, &length));
+		if (to > blocks)
+			to = blocks;
 	}
 	/*
-	 * write file inode blocks
+	 * a corrupt copy (found to be missing blocks when the file was
+	 * stat’d) is rewritten from where it broke, to the end; its index
+	 * too, as is any index that no longer lists the right blocks
 	 */
-	stegfs_block_s inode;
-	gcry_create_nonce(&inode, sizeof inode);
-	uint64_t first[SIZE_LONG_DATA];
-	if (blocks)
-		for (unsigned i = 0, j = 1; i < file_system.copies; i++, j++)
-			first[j] = htonll(file->blocks[i][1]);
-	else
-		gcry_create_nonce(first, sizeof first);
+	uint64_t start[COPIES_MAX];
+	uint64_t stop[COPIES_MAX];
+	bool reindex[COPIES_MAX];
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		start[i] = from;
+		stop[i] = to;
+		reindex[i] = file_system.indexed && file->listed != blocks;
+		for (uint64_t j = 1; j <= have && j <= blocks; j++)
+			if (!file->blocks[i][j])
+			{
+				if (j < from)
+					start[i] = j;
+				stop[i] = blocks;
+				reindex[i] = file_system.indexed;
+				break;
+			}
+		for (uint64_t j = 1; file_system.indexed && j <= file->index[i][0] && j <= index_blocks(blocks); j++)
+			if (!file->index[i][j])
+				reindex[i] = true;
+	}
+	/*
+	 * what the file already has (as far as it’s unbroken) is kept should
+	 * the write fail; only what’s claimed from here on is given back
+	 */
+	uint64_t kept[COPIES_MAX];
+	uint64_t kept_index[COPIES_MAX];
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		for (kept[i] = 0; kept[i] < file->blocks[i][0] && file->blocks[i][kept[i] + 1]; kept[i]++)
+			;
+		for (kept_index[i] = 0; file_system.indexed && kept_index[i] < file->index[i][0] && file->index[i][kept_index[i] + 1]; kept_index[i]++)
+			;
+	}
+	bool chained = file_chain(file, chain) && (!file_system.indexed || file_index(file, chain));
+	file_unreserve(file);
+	if (!chained)
+	{
+		scratch_give(mac_data);
+		return false;
+	}
+	/*
+	 * the MAC can carry on from where it was saved, if that was before
+	 * the first block to have changed; any data it (or a corrupt copy)
+	 * needs which was never read must be loaded first. Sealed copies
+	 * each have their own MAC, of their tags, which is left to when
+	 * they’re written. With a hash tree only the leaves of the blocks
+	 * to be written are hashed again (or all of them, if there’s no
+	 * tree to start from), and only they need loading
+	 */
+	uint64_t chunks = data_blocks(stored_size(file));
+	uint64_t m = stripe_data(from);
+	file_mac_s mac = { NULL, NULL };
+	if (mac_tags() || file_system.merkle)
+		m = chunks + 1;
+	else
+		mac = file_mac_open(file, &m);
+	uint64_t leaf = file->tree && file->tree_leaves == have ? from : 1;
+	uint64_t need = cipher_resumable() ? (m < from ? m : from) : 1;
+	uint64_t upto = leaf < from ? chunks : to;
+	if (file_system.merkle && leaf < need)
+		need = leaf;
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		if (start[i] < need)
+			need = start[i];
+		if (stop[i] > upto)
+			upto = stop[i];
+	}
+	bool loaded;
+	if (file_system.merkle)
+		loaded = need > upto || stegfs_file_load(file, head_length() + (need - 1) * data_length(), (upto - need + 1) * data_length());
+	else
+		loaded = file->unloaded < need || stegfs_file_load(file, 0, file->size);
+	if (!loaded)
+	{
+		file_mac_close(&mac);
+		scratch_give(mac_data);
+		return false;
+	}
+	/*
+	 * calculate the MAC from the data in memory, which is the same as
+	 * what will be in every copy on disk
+	 */
+	for (uint64_t j = m; j <= chunks; j++)
+	{
+		data_read(stored_data(file), block.data, data_length(), head_length() + (j - 1) * data_length());
+		if (j == chunks)
+			file_mac_save(&mac, file, j - 1);
+		file_mac_write(&mac, block.data, data_length());
+	}
+	if (file_system.merkle)
+	{
+		tree_update(file, leaf, leaf < from ? chunks : to);
+		mac = tree_mac(file);
+	}
+	if (!mac_tags())
+		file_mac_read(&mac, mac_data, &mac_length);
+	file_mac_close(&mac);
+	/*
+	 * build the file inode, which is the same for every copy (in the
+	 * same room as the data blocks, which are done with for now)
+	 */
+	block_s inode = block;
+	uint64_t first[COPIES_MAX + 1];
+	unsigned listed = blocks ? file_copies(file) : 0;
+	for (unsigned i = 0, j = 1; i < listed; i++, j++)
+		first[j] = htonll(file_system.indexed ? file->index[i][1] : file->blocks[i][1]);
+	random_fill(first + 1 + listed, (file_system.copies - listed) * sizeof *first);
 	first[0] = htonll(file->time);
-	memcpy(inode.data, first, sizeof first);
-	memcpy(inode.data + ((file_system.copies + 1) * sizeof( uint64_t )), mac_data, mac_length);
-	gcry_free(mac_data);
-	if (file->data && file->size)
-		memcpy(inode.data + file_system.head_offset, file->data, file->size < (sizeof inode.data - file_system.head_offset) ? file->size : (sizeof inode.data - file_system.head_offset));
-	inode.next = htonll(file->size);
+	size_t used = (file_system.copies + 1) * sizeof *first;
+	memcpy(inode.data, first, used);
+	/* (a sealed copy’s MAC is filled in as it’s written) */
+	if (!mac_tags())
+		memcpy(inode.data + used, mac_data, mac_length);
+	scratch_give(mac_data);
+	/*
+	 * then how many copies there are, and whether it’s compressed (and
+	 * if so its size before it was); whatever isn’t used (between that
+	 * and data, and after EOF) is random
+	 */
+	used += mac_length;
+	if (block_tweaks())
+		inode.data[used++] = file_copies(file);
+	if (file_system.compress)
+		inode.data[used++] = file->compressed;
+	if (file->compressed)
+	{
+		uint64_t z = htonll(file->size);
+		memcpy(inode.data + used, &z, sizeof z);
+		used += sizeof z;
+	}
+	if (used < (size_t)file_system.head_offset)
+		random_fill(inode.data + used, file_system.head_offset - used);
+	used = stored_size(file) < head_length() ? stored_size(file) : head_length();
+	if (used)
+		data_read(stored_data(file), inode.data + file_system.head_offset, used, 0);
+	random_fill(inode.data + file_system.head_offset + used, head_length() - used);
+	*inode.next = htonll(stored_size(file));
+	/*
+	 * write the data and inode of each copy; the data only from the
+	 * first block that has changed, or from the start of the chain if
+	 * the cipher can’t pick up from where the unchanged blocks left
+	 * off; once the first copy (or, when striped, the chains holding
+	 * the data) is written the rest can be left to the background, if
+	 * allowed; those written now are each given a thread, if there’s
+	 * enough to write
+	 */
+	unsigned last = file_system.async_copies ? (file_system.stripe ? : 1) : file_copies(file);
+	bool r = copies_spread(file, 0, last, start, stop, reindex, &inode);
+	if (r && last < file_copies(file) && !replica_queue(file, last, start, stop, reindex, &inode))
+	{
+		r = copies_spread(file, last, file_copies(file), start, stop, reindex, &inode);
+		last = file_copies(file);
+	}
+	if (!r)
+	{
+		/*
+		 * it’s likely that if a write failed here it won’t work for
+		 * any other copy either (in fact if a call to write fails
+		 * it’s likely all subsequent writes will fail too), but at
+		 * least the blocks claimed by this write will be marked as
+		 * available; those the file had (and its inodes, unless the
+		 * copy is new) are kept for it, and the gaps are filled again
+		 * by the next write. A new copy is forgotten, so that its
+		 * inode is claimed again then. What’s kept isn’t as it was
+		 * though: blocks from start on were rewritten in place, while
+		 * the inodes still have the old MAC (or root of the hash
+		 * tree), so the file won’t verify on disk until it’s been
+		 * written again (see stegfs_file_close, which keeps it in
+		 * memory for that)
+		 */
+		for (unsigned j = 0; j < file_copies(file); j++)
+		{
+			for (uint64_t k = claimed[j] ? 1 : kept[j] + 1; k <= file->blocks[j][0]; k++)
+				if (file->blocks[j][k])
+				{
+					block_delete(file->blocks[j][k]);
+					file->blocks[j][k] = 0;
+				}
+			for (uint64_t k = claimed[j] ? 1 : kept_index[j] + 1; file_system.indexed && k <= file->index[j][0]; k++)
+				if (file->index[j][k])
+				{
+					block_delete(file->index[j][k]);
+					file->index[j][k] = 0;
+				}
+			if (!claimed[j])
+				continue;
+			block_delete(file->inodes[j]);
+			free(file->blocks[j]);
+			file->blocks[j] = NULL;
+			free(file->index[j]);
+			file->index[j] = NULL;
+		}
+		return false;
+	}
+
+	file->listed = blocks;
+	file->dirty = UINT64_MAX;
+	file->dirty_end = 0;
+	stegfs_cache_add(NULL, file);
+	return true;
+}
+
+extern bool stegfs_file_close(stegfs_file_s *file)
+{
+	if (!file->write)
+	{
+		file_forget(file);
+		return errno = EXIT_SUCCESS, true;
+	}
+	if (flush_queue(file))
+		return errno = EXIT_SUCCESS, true;
+	/* (as in the background, a file which couldn’t be written is kept) */
+	if (!stegfs_file_write(file))
+		return false;
+	file->write = false;
+	file_forget(file);
+	return true;
+}
+
+extern void stegfs_file_wait(const char * const restrict path)
+{
+	if (!flushes.running)
+		return;
+	pthread_mutex_lock(&flushes.mutex);
+	stegfs_cache_s *c = stegfs_cache_exists(path, NULL);
+	while (c && c->file && c->file->flushing)
+		pthread_cond_wait(&flushes.cond, &flushes.mutex);
+	pthread_mutex_unlock(&flushes.mutex);
+	return;
+}
+
+extern bool stegfs_file_allocate(stegfs_file_s *file, uint64_t size)
+{
+	if (size <= file->allocated)
+		return true;
+	uint64_t z = file->size > size ? file->size : size;
+	if (!stegfs_file_will_fit(file, z))
+		return false;
+	replica_wait(file);
+	file_locate(file, NULL);
+	uint64_t chain = chain_blocks(z);
+	if (chain < file->blocks[0][0])
+		chain = file->blocks[0][0];
+	bool chained = file_chain(file, chain) && (!file_system.indexed || file_index(file, chain));
+	file_unreserve(file);
+	if (!chained)
+		return false;
+	file->allocated = size;
+	return errno = EXIT_SUCCESS, true;
+}
+
+extern bool stegfs_file_truncate(stegfs_file_s *file, uint64_t size)
+{
+	if (file_system.read_only)
+		return errno = EROFS, false;
+	/*
+	 * if the file isn’t open for writing then it’s down to us to load
+	 * it (when needed) and write it out again afterwards
+	 */
+	bool commit = !file->write;
+	bool loaded = file->data.chunks;
+	if (commit)
+	{
+		if (!size ? !stegfs_file_stat(file, true) : !stegfs_file_read(file))
+		{
+			if (errno != ENOENT)
+				return false;
+			/* truncating a file which doesn’t exist (yet) */
+			file->size = 0;
+			file->dirty = 0;
+		}
+		/* nothing before the new end of the file is needed */
+		if (!size)
+			file->unloaded = 0;
+		errno = EXIT_SUCCESS;
+	}
+	if (!stegfs_file_will_fit(file, size))
+		return false;
+	/*
+	 * only the data beyond the shorter of the old and new sizes has
+	 * changed; anything new reads back as 0's
+	 */
+	if (size < file->size)
+	{
+		/* the new last block must be in memory to be written again */
+		if (!stegfs_file_load(file, 0, file->size))
+			return false;
+		stegfs_data_truncate(file, size);
+		/* (blocks no longer in the file can’t still be waiting to be read) */
+		if (file->unloaded > data_blocks(size))
+			file->unloaded = data_blocks(size);
+		/* shrinking a file also gives back any space reserved for it */
+		if (file->allocated > size)
+			file->allocated = size;
+	}
+	if (size < file->size)
+		stegfs_file_dirty(file, size, file->size);
+	else
+		stegfs_file_dirty(file, file->size, size);
+	file->size = size;
+	file->time = time(NULL);
+	if (!commit)
+		return true;
+	bool r = stegfs_file_write(file);
+	if (!loaded)
+	{
+		stegfs_data_truncate(file, 0);
+		data_truncate(&file->packed, 0);
+	}
+	return r;
+}
+
+extern void stegfs_file_dirty(stegfs_file_s *file, uint64_t offset, uint64_t end)
+{
+	/* an end of 0 means it isn’t known, so must stay that way */
+	if (file->dirty == UINT64_MAX)
+		file->dirty_end = end;
+	else if (file->dirty_end && end > file->dirty_end)
+		file->dirty_end = end;
+	if (offset < file->dirty)
+		file->dirty = offset;
+	return;
+}
+
+extern bool stegfs_file_replicate(stegfs_file_s *file, uint32_t copies)
+{
+	if (file_system.read_only)
+		return errno = EROFS, false;
+	if (copies <= file_system.stripe || copies > file_system.copies)
+		return errno = EINVAL, false;
+	/*
+	 * as with truncate, if the file isn’t open for writing then it’s
+	 * read, and written again afterwards; a file which doesn’t exist
+	 * (yet) gets its copies when it’s first written
+	 */
+	bool commit = !file->write;
+	bool loaded = file->data.chunks;
+	if (commit && !stegfs_file_read(file))
+	{
+		if (errno != ENOENT)
+			return false;
+		file->copies = copies;
+		return errno = EXIT_SUCCESS, true;
+	}
+	replica_wait(file);
+	file_locate(file, NULL);
+	unsigned had = file_copies(file);
+	file->copies = copies;
+	if (copies > had && !stegfs_file_will_fit(file, file->size))
+	{
+		file->copies = had;
+		return false;
+	}
+	/* copies no longer wanted go now; new ones are written in full */
+	for (unsigned i = copies; i < had; i++)
+	{
+		if (!file->blocks[i])
+			continue;
+		block_delete(file->inodes[i]);
+		for (uint64_t j = 1; j <= file->blocks[i][0]; j++)
+			if (file->blocks[i][j])
+				block_delete(file->blocks[i][j]);
+		for (uint64_t j = 1; file->index[i] && j <= file->index[i][0]; j++)
+			if (file->index[i][j])
+				block_delete(file->index[i][j]);
+		free(file->blocks[i]);
+		file->blocks[i] = NULL;
+		free(file->index[i]);
+		file->index[i] = NULL;
+	}
+	/* every inode says how many copies there are, so is written again */
+	stegfs_file_dirty(file, file->size, file->size);
+	if (!commit)
+		return errno = EXIT_SUCCESS, true;
+	bool r = stegfs_file_write(file);
+	if (!loaded)
+	{
+		stegfs_data_truncate(file, 0);
+		data_truncate(&file->packed, 0);
+	}
+	return r;
+}
+
+extern bool stegfs_directory_replicate(const char * const restrict path, uint32_t copies)
+{
+	if (file_system.read_only)
+		return errno = EROFS, false;
+	if (copies > file_system.copies || (copies && copies <= file_system.stripe))
+		return errno = EINVAL, false;
+	stegfs_cache_s *c = path_equals(path, DIR_SEPARATOR) ? &file_system.cache : stegfs_cache_exists(path, NULL);
+	if (!c)
+		return errno = ENOENT, false;
+	if (c->file)
+		return errno = ENOTDIR, false;
+	c->copies = copies;
+	return errno = EXIT_SUCCESS, true;
+}
+
+extern uint32_t stegfs_directory_copies(const char * const restrict path)
+{
+	uint32_t copies = 0;
+	char *p = m_strdup(path);
+	while (!copies && !path_equals(p, DIR_SEPARATOR))
+	{
+		stegfs_cache_s *c = stegfs_cache_exists(p, NULL);
+		if (c && !c->file)
+			copies = c->copies;
+		char *q = dir_get_path(p);
+		free(p);
+		p = q;
+	}
+	free(p);
+	if (!copies)
+		copies = file_system.cache.copies;
+	return copies ? : file_system.copies;
+}
+
+extern void stegfs_file_delete(stegfs_file_s *file)
+{
+	if (file_system.read_only)
+		return;
+	char *p = m_strdupf("%s/%s", path_equals(file->path, DIR_SEPARATOR) ? "" : file->path, file->name);
+	stegfs_cache_s *c = stegfs_cache_exists(p, NULL);
+	if (c && file_known(file, c->file))
+	{
+		/*
+		 * the cached chain may be longer than the file; once deleted
+		 * it’s forgotten, so that removing the file from the cache
+		 * doesn’t give back those blocks again (by which time they
+		 * might be another file’s)
+		 */
+		for (unsigned i = 0; i < file_copies(c->file); i++)
+		{
+			block_delete(file->inodes[i]);
+			for (uint64_t j = 1; c->file->blocks[i] && j <= c->file->blocks[i][0]; j++)
+				if (c->file->blocks[i][j])
+					block_delete(c->file->blocks[i][j]);
+			for (uint64_t j = 1; c->file->index[i] && j <= c->file->index[i][0]; j++)
+				if (c->file->index[i][j])
+					block_delete(c->file->index[i][j]);
+			free(c->file->blocks[i]);
+			c->file->blocks[i] = NULL;
+			free(c->file->index[i]);
+			c->file->index[i] = NULL;
+		}
+		errno = EXIT_SUCCESS;
+		goto rfc;
+	}
+	if (!stegfs_file_stat(file))
+		goto rfc;
+	uint64_t blocks = chain_blocks(stored_size(file));
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		block_delete(file->inodes[i]);
+		for (uint64_t j = 1; j <= blocks && file->blocks[i][j]; j++)
+			block_delete(file->blocks[i][j]);
+		for (uint64_t j = 1; file->index[i] && j <= file->index[i][0] && file->index[i][j]; j++)
+			block_delete(file->index[i][j]);
+	}
+rfc:
+	stegfs_cache_remove(p);
+	free(p);
+	return;
+}
+
+extern bool stegfs_file_rename(stegfs_file_s *file, const char * const restrict path)
+{
+	/*
+	 * where a file’s inodes are, and the keys its blocks are encrypted
+	 * with, come from its path, so all of it is read (while it can still
+	 * be found) to be written again under the new one; a file which is
+	 * open for writing already has what’s changed in memory
+	 */
+	if (file_system.read_only)
+		return errno = EROFS, false;
+	bool loaded = file->data.chunks;
+	bool exists = file->write || stegfs_file_read(file);
+	if (!exists && errno != ENOENT)
+		return false;
+	if (exists && !stegfs_file_load(file, 0, file->size))
+		return false;
+	replica_wait(file);
+
+	stegfs_file_s to;
+	memset(&to, 0x00, sizeof to);
+	to.path = dir_get_path(path);
+	to.name = dir_get_name(path, PASSWORD_SEPARATOR);
+	to.pass = dir_get_pass(path);
+	to.write = file->write;
+	to.size = exists ? file->size : 0;
+	to.time = file->time;
+	to.copies = file_copies(file);
+	to.dirty = 0;
+	to.dirty_end = 0;
+	char *was = m_strdupf("%s/%s", path_equals(file->path, DIR_SEPARATOR) ? "" : file->path, file->name);
+	char *now = m_strdupf("%s/%s", path_equals(to.path, DIR_SEPARATOR) ? "" : to.path, to.name);
+	/* (only the password changes if the file stays where it is) */
+	bool moved = strcmp(was, now);
+	/*
+	 * whatever was at the new path is replaced, but only once the file
+	 * has been written there; its inodes are where the new ones have to
+	 * go, but the rest of it is kept until then
+	 */
+	stegfs_file_s old;
+	memset(&old, 0x00, sizeof old);
+	bool replace = false;
+	if (moved)
+	{
+		old.path = m_strdup(to.path);
+		old.name = m_strdup(to.name);
+		if (to.pass)
+			old.pass = m_strdup(to.pass);
+		replace = stegfs_file_stat(&old, true);
+	}
+	bool r = true;
+	if (!exists)
+	{
+		/* there’s nothing to move but the cache entry */
+		if (moved)
+		{
+			stegfs_file_delete(&old);
+			stegfs_cache_add(NULL, &to);
+			stegfs_cache_remove(was);
+		}
+		goto done;
+	}
+	/*
+	 * the new copies need room of their own, as the old ones are only
+	 * given up once they’ve been written (so are never given to them)
+	 */
+	if (!(r = stegfs_file_will_fit(&to, to.size)))
+		goto done;
+	if (moved)
+		stegfs_cache_remove(now);
+	/* (without the old chain, so that it’s written in new blocks) */
+	if (replace)
+		for (unsigned i = 0; i < file_copies(&to); i++)
+		{
+			to.inodes[i] = old.inodes[i];
+			block_mark(to.inodes[i], &to);
+			to.blocks[i] = m_calloc(2, sizeof( uint64_t ));
+			if (file_system.indexed)
+				to.index[i] = m_calloc(1, sizeof( uint64_t ));
+		}
+	file_unreserve(file);
+	unsigned copies = file_copies(file);
+	uint64_t inodes[COPIES_MAX];
+	uint64_t *blocks[COPIES_MAX];
+	uint64_t *index[COPIES_MAX];
+	memcpy(inodes, file->inodes, sizeof inodes);
+	memcpy(blocks, file->blocks, sizeof blocks);
+	memcpy(index, file->index, sizeof index);
+	memset(file->blocks, 0x00, sizeof file->blocks);
+	memset(file->index, 0x00, sizeof file->index);
+	to.data = file->data;
+	memset(&file->data, 0x00, sizeof file->data);
+	if (!(r = stegfs_file_write(&to)))
+	{
+		/*
+		 * the old file is kept as it was, though a copy of it might
+		 * not be readable any more if one of the new inodes was
+		 * written over one of its blocks (where they are can’t be
+		 * chosen); the same goes for whatever was to be replaced
+		 */
+		memcpy(file->blocks, blocks, sizeof blocks);
+		memcpy(file->index, index, sizeof index);
+		file->data = to.data;
+		memset(&to.data, 0x00, sizeof to.data);
+		goto done;
+	}
+	/*
+	 * then the old copies are deleted, bar any block that one of the new
+	 * inodes landed on (where they are can’t be chosen)
+	 */
+	for (unsigned i = 0; i < copies; i++)
+	{
+		for (uint64_t j = 0; blocks[i] && j <= blocks[i][0]; j++)
+			if ((j ? blocks[i][j] : inodes[i]) && !file_inode(&to, j ? blocks[i][j] : inodes[i]))
+				block_delete(j ? blocks[i][j] : inodes[i]);
+		for (uint64_t j = 1; index[i] && j <= index[i][0]; j++)
+			if (index[i][j] && !file_inode(&to, index[i][j]))
+				block_delete(index[i][j]);
+	}
 	for (unsigned i = 0; i < file_system.copies; i++)
 	{
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		if (!block_write(file->inodes[i], inode, cipher_handle, file->path))
+		free(blocks[i]);
+		free(index[i]);
+	}
+	/* as is what was replaced */
+	for (unsigned i = 0; replace && i < file_copies(&old); i++)
+	{
+		for (uint64_t j = 1; old.blocks[i] && j <= old.blocks[i][0]; j++)
+			if (old.blocks[i][j] && !file_inode(&to, old.blocks[i][j]))
+				block_delete(old.blocks[i][j]);
+		for (uint64_t j = 1; old.index[i] && j <= old.index[i][0]; j++)
+			if (old.index[i][j] && !file_inode(&to, old.index[i][j]))
+				block_delete(old.index[i][j]);
+	}
+	if (moved)
+		stegfs_cache_remove(was);
+	else
+	{
+		/* nothing saved for the old password is any use with the new */
+		if (file->mac_state)
+			gcry_md_close(file->mac_state);
+		file->mac_state = NULL;
+		file->allocated = 0;
+	}
+	/* keep the data only if it was in memory before */
+	stegfs_cache_s *c = stegfs_cache_exists(now, NULL);
+	if (!loaded && c && c->file)
+	{
+		stegfs_data_truncate(c->file, 0);
+		data_truncate(&c->file->packed, 0);
+	}
+done:
+	file_unreserve(&to);
+	file_free(&to);
+	file_free(&old);
+	free(was);
+	free(now);
+	return r;
+}
+
+extern bool stegfs_file_copy(stegfs_file_s *from, uint64_t in, stegfs_file_s *to, uint64_t out, uint64_t size)
+{
+	uint64_t end = out + size;
+	if (!size)
+		return errno = EXIT_SUCCESS, true;
+	if (!stegfs_file_will_fit(to, to->size > end ? to->size : end))
+		return false;
+	if (!stegfs_file_load(from, in, size) || !stegfs_file_load(to, out, size))
+		return false;
+	/*
+	 * the data goes straight from one file’s buffer to the other’s (all
+	 * of it at once if it’s the whole file); it’s encrypted when the copy
+	 * is written, each of its copies by a thread of its own
+	 */
+	if (!in && !out && size == from->size && to->size <= size)
+		data_copy(&to->data, &from->data);
+	else
+	{
+		uint8_t *buffer = m_malloc(data_length());
+		for (uint64_t done = 0; done < size; )
+		{
+			size_t l = size - done < data_length() ? size - done : data_length();
+			data_read(&from->data, buffer, l, in + done);
+			data_write(&to->data, buffer, l, out + done);
+			done += l;
+		}
+		free(buffer);
+	}
+	stegfs_file_dirty(to, out, end);
+	if (end > to->size)
+		to->size = end;
+	to->time = time(NULL);
+	return errno = EXIT_SUCCESS, true;
+}
+
+/*
+ * find where a file’s inodes and blocks are; if it doesn’t exist yet
+ * then claim its inodes ready for it to be written (noting which copies
+ * those were, if asked)
+ */
+static void file_locate(stegfs_file_s *file, bool *claimed)
+{
+	/*
+	 * only go looking for the file if we don’t already know where its
+	 * blocks are (from when it was read or last written)
+	 */
+	if (!file->blocks[0] || !file->inodes[0])
+	{
+		uint64_t z = file->size;
+		time_t t = file->time;
+		uint32_t c = file->copies;
+		if (!stegfs_file_stat(file, true))
+		{
+			file->copies = c;
+			file->listed = 0;
+			file->dirty = 0;
+		}
+		/* stat can cause size to be reset to 0 */
+		file->size = z;
+		file->time = t;
+	}
+	/*
+	 * claim the inodes of a new file, or of copies the file didn’t
+	 * have before, ready for them to be written; having no blocks
+	 * they’re written in full
+	 */
+	uint64_t have = file->blocks[0] ? file->blocks[0][0] : 0;
+	uint64_t listed = file->index[0] ? file->index[0][0] : 0;
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		if (claimed)
+			claimed[i] = !file->blocks[i];
+		if (file->blocks[i])
+			continue;
+		/*
+		 * allocate inodes, mark as in use (inode locations are
+		 * calculated in stegfs_file_stat)
+		 */
+		block_mark(file->inodes[i], file);
+		/*
+		 * note-to-self: allocate 2 more blocks than is necessary
+		 * so that block[0] indicates how many blocks there are,
+		 * and block[last] is kept 0x00 as an “end of chain”
+		 * guard; the chain itself is allocated by file_chain, as
+		 * for any file that grows
+		 */
+		file->blocks[i] = m_calloc(have + 2, sizeof( uint64_t ));
+		file->blocks[i][0] = have;
+		if (file_system.indexed)
+		{
+			file->index[i] = m_calloc(listed + 1, sizeof( uint64_t ));
+			file->index[i][0] = listed;
+		}
+	}
+	return;
+}
+
+/*
+ * grow or shrink each copy of a file’s chain to the given number of
+ * blocks, assigning blocks to new parts of the chain and to any which
+ * were found to be missing when the file was stat’d
+ */
+static bool file_chain(stegfs_file_s *file, uint64_t blocks)
+{
+	uint64_t have = file->blocks[0][0];
+	if (blocks > have) /* need more blocks than we have */
+		for (unsigned i = 0; i < file_copies(file); i++)
+		{
+			file->blocks[i] = m_realloc(file->blocks[i], (blocks + 2) * sizeof blocks);
+			memset(file->blocks[i] + have + 1, 0x00, (blocks - have + 1) * sizeof blocks);
+		}
+	else if (blocks < have) /* have more blocks than we need */
+		for (unsigned i = 0; i < file_copies(file); i++)
+		{
+			for (uint64_t j = blocks + 1; j <= have; j++)
+				if (file->blocks[i][j])
+					block_delete(file->blocks[i][j]);
+			file->blocks[i] = m_realloc(file->blocks[i], (blocks + 2) * sizeof blocks);
+			file->blocks[i][blocks + 1] = 0;
+		}
+	for (unsigned i = 0; i < file_copies(file); i++)
+		for (uint64_t j = 1; j <= blocks; j++)
+			if (!file->blocks[i][j])
+			{
+				if (!(file->blocks[i][j] = block_assign(file->path)))
+				{
+					/* failed to allocate space; free what we had claimed */
+					for (unsigned k = 0; k <= i; k++)
+						for (uint64_t l = have + 1; l <= blocks; l++)
+							if (file->blocks[k][l])
+							{
+								block_release(file->blocks[k][l]);
+								file->blocks[k][l] = 0;
+							}
+					return errno = ENOSPC, false;
+				}
+				if (file_system.show_bloc)
+					m_asprintf(&file_system.blocks.file[normalize(file->blocks[i][j])], "../%s/%s", file->path, file->name);
+			}
+	for (unsigned i = 0; i < file_copies(file); i++)
+		file->blocks[i][0] = blocks;
+	return true;
+}
+
+/*
+ * grow or shrink the index of each copy of a file to list the given
+ * number of blocks, as file_chain does for the blocks themselves (and
+ * as with them, any beyond the end of the file aren’t written)
+ */
+static bool file_index(stegfs_file_s *file, uint64_t blocks)
+{
+	uint64_t need = index_blocks(blocks);
+	uint64_t have = file->index[0][0];
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		for (uint64_t j = need + 1; j <= have; j++)
+			if (file->index[i][j])
+				block_delete(file->index[i][j]);
+		file->index[i] = m_realloc(file->index[i], (need + 1) * sizeof need);
+		if (need > have)
+			memset(file->index[i] + have + 1, 0x00, (need - have) * sizeof need);
+	}
+	for (unsigned i = 0; i < file_copies(file); i++)
+		for (uint64_t j = 1; j <= need; j++)
+			if (!file->index[i][j])
+			{
+				if (!(file->index[i][j] = block_assign(file->path)))
+				{
+					/* failed to allocate space; free what we had claimed */
+					for (unsigned k = 0; k <= i; k++)
+						for (uint64_t l = have + 1; l <= need; l++)
+							if (file->index[k][l])
+							{
+								block_release(file->index[k][l]);
+								file->index[k][l] = 0;
+							}
+					return errno = ENOSPC, false;
+				}
+				if (file_system.show_bloc)
+					m_asprintf(&file_system.blocks.file[normalize(file->index[i][j])], "../%s/%s", file->path, file->name);
+			}
+	for (unsigned i = 0; i < file_copies(file); i++)
+		file->index[i][0] = need;
+	return true;
+}
+
+/*
+ * read the index of a copy of a file, starting from the given (first)
+ * index block, filling in (and claiming) the blocks it lists; the data
+ * blocks themselves aren’t read
+ */
+static bool index_read(stegfs_file_s *file, unsigned copy, uint64_t first, gcry_cipher_hd_t cipher)
+{
+	uint64_t blocks = file->blocks[copy][0];
+	uint64_t listing = list_blocks(blocks);
+	uint64_t n = index_blocks(blocks);
+	file->index[copy] = m_realloc(file->index[copy], (n + 1) * sizeof n);
+	memset(file->index[copy], 0x00, (n + 1) * sizeof n);
+	file->index[copy][0] = n;
+	if (n)
+		file->index[copy][1] = first;
+	/* every copy has the same hash tree; it’s only needed from one */
+	size_t bytes = file_system.merkle && !file->tree ? tree_nodes(blocks) * node_length() : 0;
+	uint8_t *tree = bytes ? m_malloc(bytes) : NULL;
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	for (uint64_t k = 1; k <= n; k++)
+	{
+		cipher_seek(cipher, file, copy, index_tweak(k));
+		if (!block_read(file->index[copy][k], &block, cipher, file->path))
+		{
+			/* forget the rest of the index, and the blocks it would have listed */
+			memset(file->index[copy] + k, 0x00, (n - k + 1) * sizeof n);
+			if (k <= listing)
+				memset(file->blocks[copy] + (k - 1) * index_entries() + 1, 0x00, (blocks - (k - 1) * index_entries()) * sizeof n);
+			free(tree);
+			return false;
+		}
+		block_mark(file->index[copy][k], file);
+		if (k > listing && tree)
+		{
+			size_t o = (k - listing - 1) * data_length();
+			memcpy(tree + o, block.data, bytes - o < data_length() ? bytes - o : data_length());
+		}
+		for (uint64_t e = 0, j = (k - 1) * index_entries() + 1; k <= listing && e < index_entries() && j <= blocks; e++, j++)
+		{
+			uint64_t b;
+			memcpy(&b, block.data + e * sizeof b, sizeof b);
+			file->blocks[copy][j] = ntohll(b);
+			block_mark(file->blocks[copy][j], file);
+		}
+		if (k < n)
+			file->index[copy][k + 1] = ntohll(*block.next);
+	}
+	if (tree)
+	{
+		file->tree = tree;
+		file->tree_leaves = blocks;
+		file->tree_dirty = file->tree_dirty_end = 0;
+	}
+	file->listed = blocks;
+	return true;
+}
+
+/*
+ * write the index of a copy of a file (all of it, or just the blocks of
+ * its hash tree which have changed); whatever’s after the last block
+ * listed, and after the tree, is random
+ */
+static bool index_write(const stegfs_file_s * const restrict file, unsigned copy, gcry_cipher_hd_t cipher, const uint8_t *path, bool all)
+{
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	uint64_t blocks = chain_blocks(stored_size(file));
+	uint64_t listing = list_blocks(blocks);
+	uint64_t n = index_blocks(blocks);
+	size_t tree = file_system.merkle ? tree_nodes(blocks) * node_length() : 0;
+	for (uint64_t k = 1; k <= n; k++)
+	{
+		if (k > listing)
+		{
+			if (!all && !tree_changed(file, k - listing))
+				continue;
+			size_t o = (k - listing - 1) * data_length();
+			size_t l = tree - o < data_length() ? tree - o : data_length();
+			memcpy(block.data, file->tree + o, l);
+			if (l < data_length())
+				random_fill(block.data + l, data_length() - l);
+		}
+		else
+		{
+			if (!all)
+				continue;
+			uint64_t e = 0;
+			for (uint64_t j = (k - 1) * index_entries() + 1; e < index_entries() && j <= blocks; e++, j++)
+			{
+				uint64_t b = htonll(file->blocks[copy][j]);
+				memcpy(block.data + e * sizeof b, &b, sizeof b);
+			}
+			if (e < index_entries())
+				random_fill(block.data + e * sizeof( uint64_t ), data_length() - e * sizeof( uint64_t ));
+		}
+		block_path(&block, path);
+		*block.next = htonll(k < n ? file->index[copy][k + 1] : 0);
+		if (!block_sealed())
+			block_hash(&block);
+		cipher_seek(cipher, file, copy, index_tweak(k));
+		if (!block_encrypt(file->index[copy][k], &block, cipher))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * give back the space reserved for a file; once blocks are assigned to
+ * it they’re counted as used instead
+ */
+static void file_unreserve(stegfs_file_s *file)
+{
+	if (!file->reserved)
+		return;
+	__atomic_sub_fetch(&file_system.blocks.reserved, file->reserved, __ATOMIC_ACQ_REL);
+	file->reserved = 0;
+	return;
+}
+
+/*
+ * read the start of a file (and its MAC) from the first of its inodes
+ * that can be read
+ */
+static bool file_head(stegfs_file_s *file, uint8_t *mac)
+{
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		if (i == 1)
+			replica_wait(file);
+		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
+		uint64_t raw[block_words()];
+		block_s inode = block_parts(raw);
+		bool r = block_read(file->inodes[i], &inode, cipher_handle, file->path);
+		gcry_cipher_close(cipher_handle);
+		if (!r)
+			continue;
+		data_write(stored_data(file), inode.data + file_system.head_offset, stored_size(file) < head_length() ? stored_size(file) : head_length(), 0);
+		if (mac)
+			memcpy(mac, inode.data + ((file_system.copies + 1) * sizeof( uint64_t )), gcry_mac_get_algo_maclen(file_system.mac));
+		return true;
+	}
+	return errno = EIO, false;
+}
+
+/*
+ * read blocks first to last of a file, from the first copy that has
+ * them, picking up the cipher part way along the chain if possible
+ */
+static bool file_load(stegfs_file_s *file, uint64_t first, uint64_t last)
+{
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	for (unsigned i = 0; i < file_copies(file); i++)
+	{
+		if (i == 1)
+			replica_wait(file);
+		if (file->blocks[i][0] < last)
+			continue;
+		uint64_t f = first;
+		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
+		if (!cipher_resume(cipher_handle, file, i, f))
+			f = 1;
+		blocks_prefetch(file->blocks[i], f, last);
+		bool failed = false;
+		for (uint64_t j = f; j <= last && !failed; j++)
+		{
+			cipher_seek(cipher_handle, file, i, j);
+			if (!file->blocks[i][j] || !block_read(file->blocks[i][j], &block, cipher_handle, file->path))
+				failed = true;
+			else if (j >= first)
+			{
+				uint64_t o = head_length() + (j - 1) * data_length();
+				data_write(stored_data(file), block.data, stored_size(file) - o < data_length() ? stored_size(file) - o : data_length(), o);
+			}
+		}
+		gcry_cipher_close(cipher_handle);
+		if (!failed)
+			return true;
+	}
+	return errno = EIO, false;
+}
+
+/*
+ * read a striped file, a stripe at a time: from its data blocks, if they
+ * can be read, otherwise from as many as are needed of the parity blocks
+ * too; the MAC is of the data, however it was found
+ */
+static bool file_stripes(stegfs_file_s *file, const uint8_t *mac_data)
+{
+	unsigned copies = file_copies(file);
+	uint64_t blocks = chain_blocks(stored_size(file));
+	uint64_t chunks = data_blocks(stored_size(file));
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	uint8_t *shards = m_malloc(copies * data_length());
+	gcry_cipher_hd_t cipher_handle[COPIES_MAX] = { NULL };
+	uint64_t m = 1;
+	file_mac_s mac = file_mac_open(file, &m);
+	bool failed = false;
+	/* the parity is only wanted where the data can’t be read */
+	for (unsigned i = 0; i < file_system.stripe; i++)
+		blocks_prefetch(file->blocks[i], 1, blocks);
+	for (uint64_t j = 1; j <= blocks && !failed; j++)
+	{
+		bool found[COPIES_MAX] = { false };
+		unsigned n = 0;
+		for (unsigned i = 0; i < copies && n < file_system.stripe; i++)
+		{
+			/* the parity might not have been written yet */
+			if (i == file_system.stripe)
+				replica_wait(file);
+			if (!file->blocks[i] || file->blocks[i][0] < j || !file->blocks[i][j])
+				continue;
+			if (!cipher_handle[i])
+				cipher_handle[i] = init_cipher(file, i);
+			cipher_seek(cipher_handle[i], file, i, j);
+			if (!block_read(file->blocks[i][j], &block, cipher_handle[i], file->path))
+				continue;
+			memcpy(shards + i * data_length(), block.data, data_length());
+			found[i] = true;
+			n++;
+		}
+		if (n < file_system.stripe || !stripe_decode(shards, found, copies))
+		{
+			failed = true;
+			break;
+		}
+		for (unsigned i = 0; i < file_system.stripe; i++)
+		{
+			uint64_t k = stripe_data(j) + i;
+			if (k > chunks)
+				break;
+			uint64_t o = head_length() + (k - 1) * data_length();
+			data_write(stored_data(file), shards + i * data_length(), stored_size(file) - o < data_length() ? stored_size(file) - o : data_length(), o);
+			if (k == chunks)
+				file_mac_save(&mac, file, k - 1);
+			file_mac_write(&mac, shards + i * data_length(), data_length());
+		}
+	}
+	for (unsigned i = 0; i < copies; i++)
+		if (cipher_handle[i])
+			gcry_cipher_close(cipher_handle[i]);
+	free(shards);
+	if (!failed && !file_mac_verify(&mac, mac_data, gcry_mac_get_algo_maclen(file_system.mac)))
+		failed = true;
+	file_mac_close(&mac);
+	return !failed;
+}
+
+/*
+ * whether enough of a striped file was found for it to be read: as many
+ * blocks of every stripe as there are chains of data
+ */
+static bool stripes_complete(const stegfs_file_s * const restrict file, unsigned copies)
+{
+	uint64_t blocks = chain_blocks(stored_size(file));
+	for (uint64_t j = 1; j <= blocks; j++)
+	{
+		unsigned n = 0;
+		for (unsigned i = 0; i < copies; i++)
+			if (file->blocks[i] && file->blocks[i][0] >= j && file->blocks[i][j])
+				n++;
+		if (n < file_system.stripe)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * write copies first to last (exclusive) of a file side by side: each
+ * block of data is read, and hashed, once and then encrypted in to every
+ * copy while it’s still to hand; a copy whose cipher can pick up part
+ * way joins in when its first changed block comes round, and (if blocks
+ * are encrypted on their own) drops out after its last. A copy that
+ * fails is dropped (without its inode) and the rest carry on. When
+ * striped, each chain has its own block of every stripe instead, so the
+ * whole stripe is put together first
+ */
+static bool copies_write(const stegfs_file_s * const restrict file, unsigned first, unsigned last, const uint64_t *start, const uint64_t *stop, const bool *reindex, const block_s * const restrict inode)
+{
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	uint64_t blocks = chain_blocks(stored_size(file));
+	uint8_t *shards = file_system.stripe ? m_malloc(last * data_length()) : NULL;
+	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
+	uint8_t *path = NULL;
+	if (!path_equals(file->path, DIR_SEPARATOR))
+	{
+		path = scratch_take(hash_length);
+		gcry_md_hash_buffer(file_system.hash, path, file->path, strlen(file->path));
+	}
+	gcry_cipher_hd_t cipher_handle[COPIES_MAX];
+	uint64_t from[COPIES_MAX];
+	bool failed[COPIES_MAX] = { false };
+	uint64_t to[COPIES_MAX];
+	uint64_t lowest = blocks + 1;
+	uint64_t highest = 0;
+	for (unsigned i = first; i < last; i++)
+	{
+		cipher_handle[i] = init_cipher(file, i);
+		from[i] = cipher_resume(cipher_handle[i], file, i, start[i]) ? start[i] : 1;
+		to[i] = block_tweaks() ? stop[i] : blocks;
+		if (from[i] < lowest)
+			lowest = from[i];
+		if (to[i] > highest)
+			highest = to[i];
+	}
+	for (uint64_t j = lowest; j <= highest; j++)
+	{
+		/* the block is padded with 0's after EOF */
+		if (shards)
+			stripe_encode(file, j, shards, last);
+		else
+			data_read(stored_data(file), block.data, data_length(), head_length() + (j - 1) * data_length());
+		if (!shards && !block_sealed())
+			block_hash(&block);
+		for (unsigned i = first; i < last; i++)
+		{
+			if (failed[i] || j < from[i] || j > to[i])
+				continue;
+			if (shards)
+			{
+				memcpy(block.data, shards + i * data_length(), data_length());
+				if (!block_sealed())
+					block_hash(&block);
+			}
+			block_path(&block, path);
+			/* reserved blocks after the last aren’t part of the chain (yet) */
+			*block.next = htonll(j < blocks ? file->blocks[i][j + 1] : 0);
+			cipher_seek(cipher_handle[i], file, i, j);
+			failed[i] = !block_encrypt(file->blocks[i][j], &block, cipher_handle[i]);
+		}
+	}
+	free(shards);
+	/* (the part of the hash tree that changed is written too, whether or not the list of blocks did) */
+	for (unsigned i = first; i < last; i++)
+		if (!failed[i] && (reindex[i] || file_system.merkle))
+			failed[i] = !index_write(file, i, cipher_handle[i], path, reindex[i]);
+	memcpy(raw, inode->path, file_system.blocksize);
+	if (!block_sealed())
+		block_hash(&block);
+	bool r = true;
+	for (unsigned i = first; i < last; i++)
+	{
+		if (!failed[i])
+		{
+			if (mac_tags())
+				file_mac_tags(file, i, block.data + (file_system.copies + 1) * sizeof( uint64_t ));
+			block_path(&block, path);
+			cipher_seek(cipher_handle[i], file, i, 0);
+			failed[i] = !block_encrypt(file->inodes[i], &block, cipher_handle[i]);
+		}
+		gcry_cipher_close(cipher_handle[i]);
+		r = r && !failed[i];
+	}
+	if (path)
+		scratch_give(path);
+	return r;
+}
+
+/*
+ * write copies first to last (exclusive) of a file, as copies_write, but
+ * shared between as many threads as there are processors when there are
+ * enough blocks to write; each thread reads (and hashes) the data for
+ * itself, which costs little next to encrypting it. The chains of a
+ * striped file are made from the same stripes, so are kept together
+ */
+static bool copies_spread(const stegfs_file_s * const restrict file, unsigned first, unsigned last, const uint64_t *start, const uint64_t *stop, const bool *reindex, const block_s * const restrict inode)
+{
+	uint64_t blocks = chain_blocks(stored_size(file));
+	uint64_t most = 0;
+	for (unsigned i = first; i < last; i++)
+	{
+		uint64_t from = cipher_resumable() ? start[i] : 1;
+		uint64_t to = block_tweaks() ? stop[i] : blocks;
+		if (to >= from && to - from + 1 > most)
+			most = to - from + 1;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned runs = last - first;
+	if (cpus > 0 && runs > (unsigned)cpus)
+		runs = cpus;
+	if (file_system.stripe || most < COPIES_RUN || runs < 2)
+		return copies_write(file, first, last, start, stop, reindex, inode);
+	copies_s run[runs];
+	pthread_t thread[runs];
+	bool started[runs];
+	unsigned step = (last - first + runs - 1) / runs;
+	for (unsigned i = 0; i < runs; i++)
+	{
+		unsigned f = first + i * step;
+		run[i] = (copies_s){ file, f, f + step < last ? f + step : last, start, stop, reindex, inode, false };
+		started[i] = i && run[i].first < run[i].last && !pthread_create(&thread[i], NULL, copies_worker, &run[i]);
+	}
+	/* (any run that didn’t get a thread is done here, as is the first) */
+	for (unsigned i = 0; i < runs; i++)
+		if (!started[i])
+			copies_worker(&run[i]);
+	bool r = true;
+	for (unsigned i = 0; i < runs; i++)
+	{
+		if (started[i])
+			pthread_join(thread[i], NULL);
+		r = r && run[i].written;
+	}
+	return r;
+}
+
+static void *copies_worker(void *arg)
+{
+	copies_s *run = arg;
+	run->written = run->first >= run->last || copies_write(run->file, run->first, run->last, run->start, run->stop, run->reindex, run->inode);
+	return NULL;
+}
+
+/*
+ * queue the copies of a file from first on to be written in the
+ * background; false if they’ll have to be written now (because it’s not
+ * allowed, or the queue is full)
+ */
+static bool replica_queue(const stegfs_file_s * const restrict file, unsigned first, const uint64_t *start, const uint64_t *stop, const bool *reindex, const block_s * const restrict inode)
+{
+	if (!file_system.async_copies)
+		return false;
+	uint64_t blocks = data_blocks(stored_size(file));
+	uint64_t bytes = sizeof( replica_s ) + (blocks + 1) * file_system.blocksize;
+	pthread_mutex_lock(&replicas.mutex);
+	if (replicas.bytes + bytes > COPIES_QUEUE_MAX)
+	{
+		pthread_mutex_unlock(&replicas.mutex);
+		return false;
+	}
+	if (!replicas.running)
+	{
+		if (pthread_create(&replicas.worker, NULL, replica_worker, NULL))
+		{
+			pthread_mutex_unlock(&replicas.mutex);
+			return false;
+		}
+		replicas.running = true;
+	}
+	replicas.bytes += bytes;
+	pthread_mutex_unlock(&replicas.mutex);
+	/*
+	 * take a copy of everything needed to write the other copies; the
+	 * head of the file is already in the inode, and the data is as
+	 * stored (so the copy needn’t know whether it was compressed)
+	 */
+	replica_s *r = m_calloc(1, sizeof( replica_s ));
+	r->file.path = m_strdup(file->path);
+	r->file.name = m_strdup(file->name);
+	if (file->pass)
+		r->file.pass = m_strdup(file->pass);
+	r->file.size = stored_size(file);
+	r->file.time = file->time;
+	r->file.dirty = UINT64_MAX;
+	r->file.copies = file_copies(file);
+	r->first = first;
+	const stegfs_data_s *data = stored_data(file);
+	r->file.data.chunks = blocks + 1;
+	r->file.data.chunk = m_calloc(blocks + 1, sizeof( uint8_t * ));
+	for (uint64_t j = 1; j <= blocks && j < data->chunks; j++)
+		if (data->chunk[j])
+		{
+			r->file.data.chunk[j] = m_malloc(data_length());
+			memcpy(r->file.data.chunk[j], data->chunk[j], data_length());
+		}
+	for (unsigned i = first; i < r->file.copies; i++)
+	{
+		r->file.inodes[i] = file->inodes[i];
+		r->file.blocks[i] = m_malloc((file->blocks[i][0] + 2) * sizeof( uint64_t ));
+		memcpy(r->file.blocks[i], file->blocks[i], (file->blocks[i][0] + 2) * sizeof( uint64_t ));
+		if (file_system.indexed)
+		{
+			r->file.index[i] = m_malloc((file->index[i][0] + 1) * sizeof( uint64_t ));
+			memcpy(r->file.index[i], file->index[i], (file->index[i][0] + 1) * sizeof( uint64_t ));
+		}
+	}
+	if (file->tree)
+	{
+		r->file.tree = m_malloc(tree_nodes(file->tree_leaves) * node_length());
+		memcpy(r->file.tree, file->tree, tree_nodes(file->tree_leaves) * node_length());
+		r->file.tree_leaves = file->tree_leaves;
+		r->file.tree_dirty = file->tree_dirty;
+		r->file.tree_dirty_end = file->tree_dirty_end;
+	}
+	memcpy(r->start, start, sizeof r->start);
+	memcpy(r->stop, stop, sizeof r->stop);
+	memcpy(r->reindex, reindex, sizeof r->reindex);
+	r->inode = m_malloc(file_system.blocksize);
+	memcpy(r->inode, inode->path, file_system.blocksize);
+	r->bytes = bytes;
+	__atomic_add_fetch(&file_system.copies_pending, r->file.copies - first, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&replicas.mutex);
+	if (replicas.tail)
+		replicas.tail->next = r;
+	else
+		replicas.head = r;
+	replicas.tail = r;
+	pthread_cond_broadcast(&replicas.cond);
+	pthread_mutex_unlock(&replicas.mutex);
+	return true;
+}
+
+/*
+ * whether any copies of the file are still to be written (call with the
+ * queue locked)
+ */
+static bool replica_pending(const stegfs_file_s * const restrict file)
+{
+	if (replicas.busy && !strcmp(replicas.busy->file.path, file->path) && !strcmp(replicas.busy->file.name, file->name))
+		return true;
+	for (replica_s *r = replicas.head; r; r = r->next)
+		if (!strcmp(r->file.path, file->path) && !strcmp(r->file.name, file->name))
+			return true;
+	return false;
+}
+
+/*
+ * wait until the background copies of a file have been written; needed
+ * before its blocks are changed, or given up
+ */
+static void replica_wait(const stegfs_file_s * const restrict file)
+{
+	if (!replicas.running)
+		return;
+	pthread_mutex_lock(&replicas.mutex);
+	while (replica_pending(file))
+		pthread_cond_wait(&replicas.cond, &replicas.mutex);
+	pthread_mutex_unlock(&replicas.mutex);
+	return;
+}
+
+static void replica_free(replica_s *r)
+{
+	stegfs_data_truncate(&r->file, 0);
+	for (unsigned i = 1; i < file_system.copies; i++)
+	{
+		free(r->file.blocks[i]);
+		free(r->file.index[i]);
+	}
+	free(r->file.tree);
+	free(r->file.path);
+	free(r->file.name);
+	free(r->file.pass);
+	free(r->inode);
+	free(r);
+	return;
+}
+
+/*
+ * write the queued copies, one file at a time, until told to stop and
+ * there’s nothing left to do
+ */
+static void *replica_worker(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&replicas.mutex);
+	while (true)
+	{
+		while (!replicas.head && !replicas.stop)
+			pthread_cond_wait(&replicas.cond, &replicas.mutex);
+		replica_s *r = replicas.head;
+		if (!r)
+			break;
+		if (!(replicas.head = r->next))
+			replicas.tail = NULL;
+		replicas.busy = r;
+		pthread_mutex_unlock(&replicas.mutex);
+		/*
+		 * there’s nothing to be done if a copy can’t be written; the
+		 * file is still complete without it
+		 */
+		block_s inode = block_parts(r->inode);
+		copies_write(&r->file, r->first, r->file.copies, r->start, r->stop, r->reindex, &inode);
+		__atomic_sub_fetch(&file_system.copies_pending, r->file.copies - r->first, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&replicas.mutex);
+		replicas.busy = NULL;
+		replicas.bytes -= r->bytes;
+		pthread_cond_broadcast(&replicas.cond);
+		pthread_mutex_unlock(&replicas.mutex);
+		replica_free(r);
+		pthread_mutex_lock(&replicas.mutex);
+	}
+	pthread_mutex_unlock(&replicas.mutex);
+	return NULL;
+}
+
+/*
+ * forget the data and password of a file that’s been closed; they’ll be
+ * needed (and given) again when it’s next opened
+ */
+static void file_forget(stegfs_file_s *file)
+{
+	stegfs_data_truncate(file, 0);
+	data_truncate(&file->packed, 0);
+	free(file->pass);
+	file->pass = NULL;
+	return;
+}
+
+/*
+ * free everything held by a file that isn’t in the cache (the cache has
+ * its own copy of anything it needs)
+ */
+static void file_free(stegfs_file_s *file)
+{
+	stegfs_data_truncate(file, 0);
+	data_truncate(&file->packed, 0);
+	if (file->mac_state)
+		gcry_md_close(file->mac_state);
+	free(file->tree);
+	for (unsigned i = 0; i < file_system.copies; i++)
+	{
+		free(file->blocks[i]);
+		free(file->index[i]);
+	}
+	free(file->path);
+	free(file->name);
+	free(file->pass);
+	memset(file, 0x00, sizeof( stegfs_file_s ));
+	return;
+}
+
+/*
+ * whether a block is one of the inodes of a file
+ */
+static bool file_inode(const stegfs_file_s * const restrict file, uint64_t bid)
+{
+	for (unsigned i = 0; i < file_copies(file); i++)
+		if (normalize(bid) == normalize(file->inodes[i]))
+			return true;
+	return false;
+}
+
+/*
+ * whether where the blocks of a cached file are can be trusted instead
+ * of stat’ing it; they can be if the password given opens one of its
+ * inodes (and so it’s the same file)
+ */
+static bool file_known(stegfs_file_s *file, const stegfs_file_s * const restrict known)
+{
+	if (!known || !known->blocks[0] || !known->inodes[0])
+		return false;
+	replica_wait(known);
+	memcpy(file->inodes, known->inodes, sizeof file->inodes);
+	for (unsigned i = 0; i < file_copies(known); i++)
+	{
+		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
+		uint64_t raw[block_words()];
+		block_s inode = block_parts(raw);
+		bool r = block_read(file->inodes[i], &inode, cipher_handle, file->path);
+		gcry_cipher_close(cipher_handle);
+		if (r)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * queue a closed file to be written in the background; false if it has
+ * to be written now (because there are no threads to do it)
+ */
+static bool flush_queue(stegfs_file_s *file)
+{
+	if (!file_system.flush_threads)
+		return false;
+	pthread_mutex_lock(&flushes.mutex);
+	if (!flushes.running)
+	{
+		flushes.workers = m_calloc(file_system.flush_threads, sizeof( pthread_t ));
+		for (unsigned i = 0; i < file_system.flush_threads; i++, flushes.running++)
+			if (pthread_create(&flushes.workers[i], NULL, flush_worker, NULL))
+				break;
+		if (!flushes.running)
+		{
+			free(flushes.workers);
+			flushes.workers = NULL;
+			pthread_mutex_unlock(&flushes.mutex);
+			return false;
+		}
+	}
+	flush_s *f = m_calloc(1, sizeof( flush_s ));
+	f->file = file;
+	file->flushing = true;
+	/* (it’s closed now, as far as anyone else is concerned) */
+	file->write = false;
+	if (flushes.tail)
+		flushes.tail->next = f;
+	else
+		flushes.head = f;
+	flushes.tail = f;
+	__atomic_add_fetch(&file_system.flush_pending, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&flushes.cond);
+	pthread_mutex_unlock(&flushes.mutex);
+	return true;
+}
+
+/*
+ * write closed files until told to stop and there’s nothing left to do;
+ * as there’s no one left to tell, failures are logged and counted
+ */
+static void *flush_worker(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&flushes.mutex);
+	while (true)
+	{
+		while (!flushes.head && !flushes.stop)
+			pthread_cond_wait(&flushes.cond, &flushes.mutex);
+		flush_s *f = flushes.head;
+		if (!f)
+			break;
+		if (!(flushes.head = f->next))
+			flushes.tail = NULL;
+		pthread_mutex_unlock(&flushes.mutex);
+
+		stegfs_file_s *file = f->file;
+		free(f);
+		/*
+		 * if it couldn’t be written then what’s in memory is the only
+		 * good copy of the file, so it’s kept, as it would be were it
+		 * still open, to be written again when next it’s closed
+		 */
+		if (!stegfs_file_write(file))
+		{
+			syslog(LOG_ERR, "%s: could not write %s/%s: %s", STEGFS_NAME, path_equals(file->path, DIR_SEPARATOR) ? "" : file->path, file->name, strerror(errno));
+			__atomic_add_fetch(&file_system.flush_failed, 1, __ATOMIC_RELAXED);
+			file->write = true;
+		}
+		else
+			file_forget(file);
+		__atomic_sub_fetch(&file_system.flush_pending, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&flushes.mutex);
+		file->flushing = false;
+		pthread_cond_broadcast(&flushes.cond);
+	}
+	pthread_mutex_unlock(&flushes.mutex);
+	return NULL;
+}
+
+/*
+ * fill a buffer from this thread’s keystream, which is keyed (and then
+ * rekeyed every RANDOM_RESEED bytes) from libgcrypt’s random pool; if
+ * the keystream can’t be had, the nonce generator is used directly
+ */
+static void random_fill(void *buffer, size_t length)
+{
+	if (!length)
+		return;
+	pthread_once(&thread_once, thread_init);
+	random_s *r = pthread_getspecific(random_key);
+	if (!r)
+	{
+		r = m_calloc(1, sizeof( random_s ));
+		if (gcry_cipher_open(&r->cipher, GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_STREAM, GCRY_CIPHER_SECURE))
+		{
+			free(r);
+			gcry_create_nonce(buffer, length);
+			return;
+		}
+		pthread_setspecific(random_key, r);
+	}
+	if (r->left < length)
+	{
+		uint8_t key[32];
+		uint8_t iv[12];
+		gcry_randomize(key, sizeof key, GCRY_STRONG_RANDOM);
+		gcry_create_nonce(iv, sizeof iv);
+		gcry_cipher_setkey(r->cipher, key, sizeof key);
+		gcry_cipher_setiv(r->cipher, iv, sizeof iv);
+		memset(key, 0x00, sizeof key);
+		r->left = RANDOM_RESEED;
+	}
+	memset(buffer, 0x00, length);
+	gcry_cipher_encrypt(r->cipher, buffer, length, NULL, 0);
+	r->left = r->left > length ? r->left - length : 0;
+	return;
+}
+
+static void random_free(void *r)
+{
+	gcry_cipher_close(((random_s *)r)->cipher);
+	free(r);
+	return;
+}
+
+/*
+ * take (zeroed) memory from this thread’s arena; if it’s full (or
+ * there isn’t one) the memory comes from the secure pool instead
+ */
+static void *scratch_take(size_t length)
+{
+	pthread_once(&thread_once, thread_init);
+	scratch_s *s = pthread_getspecific(scratch_key);
+	if (!s)
+	{
+		s = m_calloc(1, sizeof( scratch_s ));
+		if (!(s->base = gcry_calloc_secure(SCRATCH_SIZE, sizeof( uint8_t ))))
+		{
+			free(s);
+			return m_gcry_calloc_secure(length, sizeof( uint8_t ));
+		}
+		pthread_setspecific(scratch_key, s);
+	}
+	length = (length + 0x0F) & ~(size_t)0x0F;
+	if (s->used + length > SCRATCH_SIZE)
+		return m_gcry_calloc_secure(length, sizeof( uint8_t ));
+	void *ptr = s->base + s->used;
+	s->used += length;
+	return ptr;
+}
+
+/*
+ * give back what was taken, along with anything taken after it; it’s
+ * wiped, ready for next time
+ */
+static void scratch_give(void *ptr)
+{
+	scratch_s *s = pthread_getspecific(scratch_key);
+	if (!s || (uint8_t *)ptr < s->base || (uint8_t *)ptr >= s->base + SCRATCH_SIZE)
+	{
+		gcry_free(ptr);
+		return;
+	}
+	size_t offset = (uint8_t *)ptr - s->base;
+	memset(ptr, 0x00, s->used - offset);
+	s->used = offset;
+	return;
+}
+
+static void scratch_free(void *s)
+{
+	gcry_free(((scratch_s *)s)->base);
+	free(s);
+	return;
+}
+
+static void thread_init(void)
+{
+	pthread_key_create(&random_key, random_free);
+	pthread_key_create(&scratch_key, scratch_free);
+	return;
+}
+
+/*
+ * queue a deleted block to be shredded in the background; false if it
+ * has to be done now (because the thread couldn’t be started)
+ */
+static bool shred_queue(uint64_t bid)
+{
+	pthread_mutex_lock(&shreds.mutex);
+	if (!shreds.running)
+	{
+		if (pthread_create(&shreds.worker, NULL, shred_worker, NULL))
+		{
+			pthread_mutex_unlock(&shreds.mutex);
+			return false;
+		}
+		shreds.running = true;
+	}
+	if (shreds.count == shreds.size)
+		shreds.blocks = m_realloc(shreds.blocks, (shreds.size = shreds.size ? shreds.size * 2 : SHRED_BATCH) * sizeof( uint64_t ));
+	shreds.blocks[shreds.count++] = bid;
+	__atomic_add_fetch(&file_system.shred_pending, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&shreds.cond);
+	pthread_mutex_unlock(&shreds.mutex);
+	return true;
+}
+
+static int shred_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * overwrite everything that’s been queued since the last time, in
+ * order of where the blocks are, until told to stop and there’s nothing
+ * left to do; a block which has been given to a file since it was
+ * queued (or was queued twice) is skipped
+ */
+static void *shred_worker(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&shreds.mutex);
+	while (true)
+	{
+		while (!shreds.count && !shreds.stop)
+			pthread_cond_wait(&shreds.cond, &shreds.mutex);
+		if (!shreds.count)
+			break;
+		uint64_t *blocks = shreds.blocks;
+		size_t count = shreds.count;
+		shreds.blocks = NULL;
+		shreds.count = 0;
+		shreds.size = 0;
+		pthread_mutex_unlock(&shreds.mutex);
+
+		qsort(blocks, count, sizeof *blocks, shred_compare);
+		for (size_t i = 0; i < count; i += SHRED_BATCH)
+		{
+			size_t n = count - i < SHRED_BATCH ? count - i : SHRED_BATCH;
+			pthread_mutex_lock(&blocks_mutex);
+			for (size_t j = 0; j < n; j++)
+			{
+				uint64_t bid = blocks[i + j];
+				if (!file_system.blocks.shred[bid])
+					continue;
+				/* the keystream goes straight into the file system */
+				random_fill(file_system.memory + (bid * file_system.blocksize), file_system.blocksize);
+				file_system.blocks.shred[bid] = false;
+			}
+			pthread_mutex_unlock(&blocks_mutex);
+		}
+		free(blocks);
+		__atomic_sub_fetch(&file_system.shred_pending, count, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&shreds.mutex);
+	}
+	pthread_mutex_unlock(&shreds.mutex);
+	return NULL;
+}
+
+/*
+ * data functions
+ */
+
+static uint64_t data_locate(uint64_t offset, size_t *within, size_t *length)
+{
+	if (offset < head_length())
+	{
+		*within = offset;
+		*length = head_length();
+		return 0;
+	}
+	lldiv_t d = lldiv(offset - head_length(), data_length());
+	*within = d.rem;
+	*length = data_length();
+	return d.quot + 1;
+}
+
+/*
+ * number of blocks needed in each chain for a file of the given size
+ * (not including the inode)
+ */
+static uint64_t data_blocks(uint64_t size)
+{
+	if (size <= head_length())
+		return 0;
+	lldiv_t d = lldiv(size - head_length(), data_length());
+	return d.quot + (d.rem > 0);
+}
+
+/*
+ * number of blocks in each chain for a file of the given size; when
+ * striped, one for each stripe
+ */
+static uint64_t chain_blocks(uint64_t size)
+{
+	uint64_t blocks = data_blocks(size);
+	if (!file_system.stripe)
+		return blocks;
+	return (blocks + file_system.stripe - 1) / file_system.stripe;
+}
+
+static void data_read(const stegfs_data_s * const restrict data, void *buffer, size_t size, uint64_t offset)
+{
+	while (size)
+	{
+		size_t within, length;
+		uint64_t c = data_locate(offset, &within, &length);
+		size_t l = length - within < size ? length - within : size;
+		if (c < data->chunks && data->chunk[c])
+			memcpy(buffer, data->chunk[c] + within, l);
+		else
+			memset(buffer, 0x00, l);
+		buffer += l;
+		offset += l;
+		size -= l;
+	}
+	return;
+}
+
+static void data_write(stegfs_data_s *data, const void *buffer, size_t size, uint64_t offset)
+{
+	while (size)
+	{
+		size_t within, length;
+		uint64_t c = data_locate(offset, &within, &length);
+		if (c >= data->chunks)
+		{
+			/*
+			 * only the array of pointers ever grows (and is moved),
+			 * the chunks themselves stay where they are
+			 */
+			uint64_t chunks = data->chunks ? : 1;
+			while (chunks <= c)
+				chunks *= 2;
+			data->chunk = m_realloc(data->chunk, chunks * sizeof( uint8_t * ));
+			memset(data->chunk + data->chunks, 0x00, (chunks - data->chunks) * sizeof( uint8_t * ));
+			data->chunks = chunks;
+		}
+		if (!data->chunk[c])
+			data->chunk[c] = m_calloc(data_length(), sizeof( uint8_t ));
+		size_t l = length - within < size ? length - within : size;
+		memcpy(data->chunk[c] + within, buffer, l);
+		buffer += l;
+		offset += l;
+		size -= l;
+	}
+	return;
+}
+
+static void data_truncate(stegfs_data_s *data, uint64_t size)
+{
+	uint64_t keep = 0;
+	if (size)
+	{
+		size_t within, length;
+		keep = data_locate(size - 1, &within, &length) + 1;
+		if (keep <= data->chunks && data->chunk[keep - 1])
+			memset(data->chunk[keep - 1] + within + 1, 0x00, length - within - 1);
+	}
+	for (uint64_t i = keep; i < data->chunks; i++)
+		if (data->chunk[i])
 		{
-			for (unsigned j = 0; j <= i; j++)
-				/*
-				 * it’s likely that if a write failed above,
-				 * it won’t work here either, but at least
-				 * the block will be marked as available
-				 * (in fact if a call to write fails it’s
-				 * likely all subsequent write will fail
-				 * too)
-				 */
-				block_delete(file->inodes[j]);
-			stegfs_file_delete(file);
-			gcry_cipher_close(cipher_handle);
-			return false;
+			free(data->chunk[i]);
+			data->chunk[i] = NULL;
 		}
-		gcry_cipher_close(cipher_handle);
+	if (!keep)
+	{
+		free(data->chunk);
+		data->chunk = NULL;
+		data->chunks = 0;
 	}
+	return;
+}
 
-	stegfs_cache_add(NULL, file);
+static void data_copy(stegfs_data_s *to, const stegfs_data_s * const restrict from)
+{
+	data_truncate(to, 0);
+	to->chunks = from->chunks;
+	to->chunk = m_calloc(from->chunks, sizeof( uint8_t * ));
+	for (uint64_t i = 0; i < from->chunks; i++)
+		if (from->chunk[i])
+		{
+			to->chunk[i] = m_malloc(data_length());
+			memcpy(to->chunk[i], from->chunk[i], data_length());
+		}
+	return;
+}
+
+extern void stegfs_data_read(const stegfs_file_s * const restrict file, void *buffer, size_t size, uint64_t offset)
+{
+	data_read(&file->data, buffer, size, offset);
+	return;
+}
+
+extern void stegfs_data_write(stegfs_file_s *file, const void *buffer, size_t size, uint64_t offset)
+{
+	data_write(&file->data, buffer, size, offset);
+	return;
+}
+
+extern void stegfs_data_truncate(stegfs_file_s *file, uint64_t size)
+{
+	data_truncate(&file->data, size);
+	return;
+}
+
+/*
+ * compression functions
+ *
+ * A compressed file is stored as a run of frames, each of COMPRESS_FRAME
+ * bytes of its data (bar the last), so that each can be compressed, or
+ * decompressed, on its own. Every frame starts with its length (as 4
+ * bytes, big endian), with COMPRESS_RAW set if it didn’t compress and is
+ * stored as it is. A file is only stored compressed if that saves at
+ * least a block.
+ */
+
+/*
+ * compress (or not) the frame of a file’s data at the given offset, to
+ * out (which has room for the header and ZSTD_compressBound of a frame);
+ * the length of the frame as stored is returned
+ */
+static size_t frame_pack(const stegfs_file_s * const restrict file, uint64_t offset, uint8_t *in, uint8_t *out)
+{
+	size_t l = file->size - offset < COMPRESS_FRAME ? file->size - offset : COMPRESS_FRAME;
+	data_read(&file->data, in, l, offset);
+	uint32_t h = sizeof h;
+	size_t z = ZSTD_compress(out + h, ZSTD_compressBound(COMPRESS_FRAME), in, l, ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(z) || z >= l)
+	{
+		memcpy(out + h, in, l);
+		z = l;
+		h = htonl(l | COMPRESS_RAW);
+	}
+	else
+		h = htonl(z);
+	memcpy(out, &h, sizeof h);
+	return sizeof h + z;
+}
+
+/*
+ * compress a file again, from the frame its changes start in; frames
+ * before that are as they were stored last time, if it was compressed
+ * then. Whether it’s now stored compressed is decided afresh, and the
+ * offset (in the data as it’s now stored) where the changes start is
+ * returned
+ */
+static uint64_t file_pack(stegfs_file_s *file, uint64_t dirty)
+{
+	bool was = file->compressed;
+	uint64_t keep = 0;
+	uint64_t stored = 0;
+	uint32_t h;
+	for (; was && file->packed.chunks && keep + COMPRESS_FRAME <= dirty && stored + sizeof h <= file->stored; keep += COMPRESS_FRAME)
+	{
+		data_read(&file->packed, &h, sizeof h, stored);
+		stored += sizeof h + (ntohl(h) & ~COMPRESS_RAW);
+	}
+	uint64_t start = stored;
+	uint8_t *in = m_malloc(COMPRESS_FRAME);
+	uint8_t *out = m_malloc(sizeof h + ZSTD_compressBound(COMPRESS_FRAME));
+	/*
+	 * a file stored as it is stays that way if what changed doesn’t
+	 * compress either, rather than trying the rest of it every time
+	 */
+	bool r = was || !dirty;
+	if (!r && dirty < file->size)
+	{
+		uint64_t o = dirty - dirty % COMPRESS_FRAME;
+		frame_pack(file, o, in, out);
+		memcpy(&h, out, sizeof h);
+		r = !(ntohl(h) & COMPRESS_RAW);
+	}
+	if (r)
+	{
+		data_truncate(&file->packed, stored);
+		for (uint64_t o = keep; o < file->size; o += COMPRESS_FRAME)
+		{
+			size_t z = frame_pack(file, o, in, out);
+			data_write(&file->packed, out, z, stored);
+			stored += z;
+		}
+		r = data_blocks(stored) < data_blocks(file->size);
+	}
+	free(in);
+	free(out);
+	if (!r)
+	{
+		data_truncate(&file->packed, 0);
+		file->compressed = false;
+		return was ? 0 : dirty;
+	}
+	file->stored = stored;
+	file->compressed = true;
+	return was ? start : 0;
+}
+
+/*
+ * decompress the whole of a file (every frame of it) from its data as
+ * stored
+ */
+static bool file_unpack(stegfs_file_s *file)
+{
+	data_truncate(&file->data, 0);
+	size_t bound = ZSTD_compressBound(COMPRESS_FRAME);
+	uint8_t *in = m_malloc(bound);
+	uint8_t *out = m_malloc(COMPRESS_FRAME);
+	bool r = true;
+	for (uint64_t o = 0, stored = 0; o < file->size && r; o += COMPRESS_FRAME)
+	{
+		size_t l = file->size - o < COMPRESS_FRAME ? file->size - o : COMPRESS_FRAME;
+		uint32_t h;
+		if (stored + sizeof h > file->stored)
+		{
+			r = false;
+			break;
+		}
+		data_read(&file->packed, &h, sizeof h, stored);
+		stored += sizeof h;
+		h = ntohl(h);
+		size_t z = h & ~COMPRESS_RAW;
+		if (z > bound || stored + z > file->stored)
+		{
+			r = false;
+			break;
+		}
+		data_read(&file->packed, in, z, stored);
+		stored += z;
+		if (h & COMPRESS_RAW)
+			r = z == l;
+		else
+			r = ZSTD_decompress(out, COMPRESS_FRAME, in, z) == l;
+		if (r)
+			data_write(&file->data, h & COMPRESS_RAW ? in : out, l, o);
+	}
+	free(in);
+	free(out);
+	file->unloaded = 0;
+	if (r)
+		return true;
+	data_truncate(&file->data, 0);
+	return errno = EIO, false;
+}
+
+/*
+ * stripe functions
+ *
+ * A striped file has its data spread across its first file_system.stripe
+ * chains (block j of chain i holds block (j - 1) × stripe + i + 1 of the
+ * file’s data), and the rest of its chains hold Reed-Solomon parity of
+ * each stripe. The parity is from a Cauchy matrix over GF(2^8), so any
+ * stripe blocks of a stripe, data or parity, are enough to rebuild it.
+ */
+
+static void gf_init(void)
+{
+	unsigned x = 1;
+	for (unsigned i = 0; i < 0xFF; i++)
+	{
+		gf_exp[i] = gf_exp[i + 0xFF] = x;
+		gf_log[x] = i;
+		if ((x <<= 1) & 0x100)
+			x ^= 0x11D;
+	}
+	return;
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[0xFF - gf_log[a]];
+}
+
+/*
+ * add c × source to destination; the product of c and a byte is that of
+ * its low and high nibbles, each found in a table of 16
+ */
+static void gf_madd(uint8_t *destination, const uint8_t *source, uint8_t c, size_t length)
+{
+	if (!c)
+		return;
+	gf_vector_t low, high;
+	for (unsigned i = 0; i < sizeof low; i++)
+	{
+		low[i] = gf_mul(c, i);
+		high[i] = gf_mul(c, i << 4);
+	}
+	size_t i = 0;
+	for (; i + sizeof low <= length; i += sizeof low)
+	{
+		gf_vector_t s, d;
+		memcpy(&s, source + i, sizeof s);
+		memcpy(&d, destination + i, sizeof d);
+		d ^= __builtin_shuffle(low, s & 0x0F) ^ __builtin_shuffle(high, s >> 4);
+		memcpy(destination + i, &d, sizeof d);
+	}
+	for (; i < length; i++)
+		destination[i] ^= gf_mul(c, source[i]);
+	return;
+}
+
+/*
+ * what data block d of a stripe is multiplied by for parity block p
+ */
+static uint8_t stripe_coefficient(unsigned p, unsigned d)
+{
+	return gf_inv((file_system.stripe + p) ^ d);
+}
+
+/*
+ * put together a stripe of a file: its data blocks (0's after EOF) then
+ * the parity blocks, up to the given chain
+ */
+static void stripe_encode(const stegfs_file_s * const restrict file, uint64_t stripe, uint8_t *shards, unsigned copies)
+{
+	for (unsigned i = 0; i < file_system.stripe; i++)
+		data_read(stored_data(file), shards + i * data_length(), data_length(), head_length() + (stripe_data(stripe) + i - 1) * data_length());
+	for (unsigned i = file_system.stripe; i < copies; i++)
+	{
+		uint8_t *parity = shards + i * data_length();
+		memset(parity, 0x00, data_length());
+		for (unsigned d = 0; d < file_system.stripe; d++)
+			gf_madd(parity, shards + d * data_length(), stripe_coefficient(i - file_system.stripe, d), data_length());
+	}
+	return;
+}
+
+/*
+ * rebuild the missing data blocks of a stripe from those found (of which
+ * there must be at least as many as there are data blocks); the rows of
+ * the code for the blocks used are inverted, and the missing data is
+ * the found blocks multiplied by that
+ */
+static bool stripe_decode(uint8_t *shards, const bool *found, unsigned copies)
+{
+	unsigned k = file_system.stripe;
+	unsigned missing = 0;
+	for (unsigned i = 0; i < k; i++)
+		if (!found[i])
+			missing++;
+	if (!missing)
+		return true;
+	unsigned use[COPIES_MAX];
+	for (unsigned i = 0, n = 0; i < copies && n < k; i++)
+		if (found[i])
+			use[n++] = i;
+	/* the code for the blocks used, alongside what will be its inverse */
+	uint8_t matrix[COPIES_MAX][COPIES_MAX * 2];
+	for (unsigned r = 0; r < k; r++)
+		for (unsigned c = 0; c < k; c++)
+		{
+			matrix[r][c] = use[r] < k ? use[r] == c : stripe_coefficient(use[r] - k, c);
+			matrix[r][k + c] = r == c;
+		}
+	for (unsigned c = 0; c < k; c++)
+	{
+		unsigned p = c;
+		while (p < k && !matrix[p][c])
+			p++;
+		if (p == k)
+			return false;
+		if (p != c)
+			for (unsigned x = 0; x < k * 2; x++)
+			{
+				uint8_t t = matrix[p][x];
+				matrix[p][x] = matrix[c][x];
+				matrix[c][x] = t;
+			}
+		uint8_t v = gf_inv(matrix[c][c]);
+		for (unsigned x = 0; x < k * 2; x++)
+			matrix[c][x] = gf_mul(matrix[c][x], v);
+		for (unsigned r = 0; r < k; r++)
+			if (r != c && matrix[r][c])
+			{
+				uint8_t f = matrix[r][c];
+				for (unsigned x = 0; x < k * 2; x++)
+					matrix[r][x] ^= gf_mul(f, matrix[c][x]);
+			}
+	}
+	/* (the blocks used are all found ones, so aren’t written over) */
+	for (unsigned d = 0; d < k; d++)
+	{
+		if (found[d])
+			continue;
+		uint8_t *data = shards + d * data_length();
+		memset(data, 0x00, data_length());
+		for (unsigned t = 0; t < k; t++)
+			gf_madd(data, shards + use[t] * data_length(), matrix[d][k + t], data_length());
+	}
 	return true;
 }
 
-extern void stegfs_file_delete(stegfs_file_s *file)
+/*
+ * tree functions
+ *
+ * A file’s MAC can be of the root of a hash tree of its blocks, instead
+ * of its data: each leaf is the hash of a block (and where it is in the
+ * file), each node above is the hash of the two below it (or of the one,
+ * at the end of a level), up to a single root. The whole tree, leaves
+ * first, is kept after the list of blocks in the index of every copy, so
+ * a block can be checked by hashing it, and its way up, against the root
+ * (which is checked once, by the MAC); a change needs only the leaves of
+ * the blocks that changed, and their way up, hashed again
+ */
+
+static uint64_t tree_nodes(uint64_t leaves)
 {
-	if (!stegfs_file_stat(file))
-		goto rfc;
-	stegfs_block_s block;
-	lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-	uint64_t blocks = d.quot + (d.rem > 0);
-	for (unsigned i = 0; i < file_system.copies; i++)
+	uint64_t n = 0;
+	for (; leaves > 1; leaves = (leaves + 1) / 2)
+		n += leaves;
+	return n + leaves;
+}
+
+/*
+ * where a level of the tree starts (counted in nodes), and how many
+ * nodes it has
+ */
+static uint64_t tree_level(uint64_t leaves, unsigned level, uint64_t *count)
+{
+	uint64_t offset = 0;
+	for (unsigned l = 0; l < level; l++)
 	{
-		block_delete(file->inodes[i]);
-		for (uint64_t j = 1; j <= blocks && file->blocks[i][j]; j++)
-			block_delete(file->blocks[i][j]);
+		offset += leaves;
+		leaves = (leaves + 1) / 2;
+	}
+	*count = leaves;
+	return offset;
+}
+
+static void tree_leaf(uint64_t block, const uint8_t *data, uint8_t *leaf)
+{
+	uint8_t kind = 0x00;
+	uint64_t b = htonll(block);
+	gcry_buffer_t parts[] =
+	{
+		{ .len = sizeof kind,   .data = &kind },
+		{ .len = sizeof b,      .data = &b },
+		{ .len = data_length(), .data = (void *)data }
+	};
+	gcry_md_hash_buffers(file_system.hash, 0, leaf, parts, sizeof parts / sizeof parts[0]);
+	return;
+}
+
+static void tree_node(const uint8_t *left, const uint8_t *right, uint8_t *node)
+{
+	uint8_t kind = 0x01;
+	gcry_buffer_t parts[] =
+	{
+		{ .len = sizeof kind,    .data = &kind },
+		{ .len = node_length(), .data = (void *)left },
+		{ .len = node_length(), .data = (void *)right }
+	};
+	gcry_md_hash_buffers(file_system.hash, 0, node, parts, right ? 3 : 2);
+	return;
+}
+
+/*
+ * hash nodes first to last (exclusive) of a level of the tree; a long
+ * enough run is shared between as many threads as there are processors,
+ * as every node of a level can be done at once
+ */
+static void tree_hash(const stegfs_file_s * const restrict file, unsigned level, uint64_t first, uint64_t last)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t runs = (last - first) / TREE_RUN;
+	if (cpus > 0 && runs > (uint64_t)cpus)
+		runs = cpus;
+	if (runs < 2)
+	{
+		tree_s run = { file, level, first, last };
+		tree_worker(&run);
+		return;
+	}
+	tree_s run[runs];
+	pthread_t thread[runs];
+	bool started[runs];
+	uint64_t step = (last - first + runs - 1) / runs;
+	for (uint64_t i = 0; i < runs; i++)
+	{
+		run[i] = (tree_s){ file, level, first + i * step, first + (i + 1) * step < last ? first + (i + 1) * step : last };
+		started[i] = i && !pthread_create(&thread[i], NULL, tree_worker, &run[i]);
+	}
+	/* (any run that didn’t get a thread is done here, as is the first) */
+	for (uint64_t i = 0; i < runs; i++)
+		if (!started[i])
+			tree_worker(&run[i]);
+	for (uint64_t i = 1; i < runs; i++)
+		if (started[i])
+			pthread_join(thread[i], NULL);
+	return;
+}
+
+static void *tree_worker(void *arg)
+{
+	const tree_s *run = arg;
+	const stegfs_file_s *file = run->file;
+	size_t length = node_length();
+	uint64_t count;
+	uint8_t *level = file->tree + tree_level(file->tree_leaves, run->level, &count) * length;
+	if (!run->level)
+	{
+		/* leaves, from the data in memory (padded with 0's after EOF, as on disk) */
+		uint8_t *data = m_malloc(data_length());
+		for (uint64_t j = run->first; j < run->last; j++)
+		{
+			data_read(stored_data(file), data, data_length(), head_length() + j * data_length());
+			tree_leaf(j + 1, data, level + j * length);
+		}
+		free(data);
+		return NULL;
+	}
+	uint8_t *below = file->tree + tree_level(file->tree_leaves, run->level - 1, &count) * length;
+	for (uint64_t j = run->first; j < run->last; j++)
+		tree_node(below + j * 2 * length, j * 2 + 1 < count ? below + (j * 2 + 1) * length : NULL, level + j * length);
+	return NULL;
+}
+
+/*
+ * bring a file’s tree up to date after blocks first to last have changed
+ * (along with any beyond the end of the old tree); if the number of
+ * blocks has changed then everything above the leaves is hashed again,
+ * otherwise just the way up from those that changed
+ */
+static void tree_update(stegfs_file_s *file, uint64_t first, uint64_t last)
+{
+	uint64_t leaves = data_blocks(stored_size(file));
+	size_t length = node_length();
+	bool relaid = file->tree_leaves != leaves || !file->tree;
+	if (relaid)
+	{
+		uint8_t *tree = leaves ? m_malloc(tree_nodes(leaves) * length) : NULL;
+		uint64_t keep = file->tree && file->tree_leaves < leaves ? file->tree_leaves : leaves;
+		if (file->tree && keep)
+			memcpy(tree, file->tree, keep * length);
+		else
+			keep = 0;
+		free(file->tree);
+		file->tree = tree;
+		file->tree_leaves = leaves;
+		if (first > keep + 1)
+			first = keep + 1;
+		last = leaves;
+	}
+	if (!leaves)
+	{
+		file->tree_dirty = file->tree_dirty_end = 0;
+		return;
+	}
+	/* (counting from 0 from here on) */
+	uint64_t a = first ? first - 1 : 0;
+	uint64_t b = last < leaves ? last : leaves;
+	file->tree_dirty = relaid ? 0 : a;
+	file->tree_dirty_end = relaid ? leaves : b;
+	if (a < b)
+		tree_hash(file, 0, a, b);
+	uint64_t count = leaves;
+	for (unsigned level = 1; count > 1; level++)
+	{
+		count = (count + 1) / 2;
+		a = relaid ? 0 : a / 2;
+		b = relaid ? count : (b + 1) / 2;
+		if (a < b)
+			tree_hash(file, level, a, b);
 	}
-rfc:
-	char *p = m_strdupf("%s/%s", path_equals(file->path, DIR_SEPARATOR) ? "" : file->path, file->name);
-	stegfs_cache_remove(p);
-	free(p);
 	return;
 }
 
+/*
+ * whether the given block of the tree (counted from 1, after the list of
+ * blocks in the index) holds any node that changed when it was last
+ * brought up to date
+ */
+static bool tree_changed(const stegfs_file_s * const restrict file, uint64_t k)
+{
+	uint64_t from = (k - 1) * data_length();
+	uint64_t to = k * data_length();
+	size_t length = node_length();
+	uint64_t a = file->tree_dirty;
+	uint64_t b = file->tree_dirty_end;
+	for (uint64_t n = file->tree_leaves, offset = 0; a < b; offset += n, n = (n + 1) / 2, a /= 2, b = (b + 1) / 2)
+	{
+		if ((offset + a) * length < to && (offset + b) * length > from)
+			return true;
+		if (n == 1)
+			break;
+	}
+	return false;
+}
+
+/*
+ * whether a block, read from disk, is the one the tree says it should
+ * be: its leaf is worked out from its data and hashed with the nodes
+ * beside it, up to the root
+ */
+static bool tree_check(const stegfs_file_s * const restrict file, uint64_t block, const uint8_t *data)
+{
+	if (!file->tree || !block || block > file->tree_leaves)
+		return false;
+	size_t length = node_length();
+	uint8_t node[length];
+	uint8_t up[length];
+	tree_leaf(block, data, node);
+	uint64_t i = block - 1;
+	uint64_t offset = 0;
+	for (uint64_t n = file->tree_leaves; n > 1; offset += n, n = (n + 1) / 2, i /= 2)
+	{
+		uint64_t s = i ^ 1;
+		if (s >= n)
+			tree_node(node, NULL, up);
+		else if (i & 1)
+			tree_node(file->tree + (offset + s) * length, node, up);
+		else
+			tree_node(node, file->tree + (offset + s) * length, up);
+		memcpy(node, up, length);
+	}
+	return !memcmp(node, file->tree + offset * length, length);
+}
+
+/*
+ * the MAC of a file with a tree, which is of its root (or of nothing, if
+ * it has no blocks beyond its head)
+ */
+static file_mac_s tree_mac(const stegfs_file_s * const restrict file)
+{
+	uint64_t m = 1;
+	file_mac_s mac = file_mac_open(file, &m);
+	if (file->tree && file->tree_leaves)
+		file_mac_write(&mac, file->tree + (tree_nodes(file->tree_leaves) - 1) * node_length(), node_length());
+	return mac;
+}
+
+static bool tree_verify(const stegfs_file_s * const restrict file, const uint8_t *mac_data)
+{
+	uint64_t leaves = data_blocks(stored_size(file));
+	if (leaves && (!file->tree || file->tree_leaves != leaves))
+		return false;
+	file_mac_s mac = tree_mac(file);
+	bool r = file_mac_verify(&mac, mac_data, gcry_mac_get_algo_maclen(file_system.mac));
+	file_mac_close(&mac);
+	return r;
+}
+
+/*
+ * read blocks first to last of a file (those not already in memory),
+ * each from the first copy that has it as the tree says it should be
+ */
+static bool tree_load(stegfs_file_s *file, uint64_t first, uint64_t last)
+{
+	uint64_t raw[block_words()];
+	block_s block = block_parts(raw);
+	gcry_cipher_hd_t cipher_handle[COPIES_MAX] = { NULL };
+	bool r = true;
+	stegfs_data_s *data = stored_data(file);
+	/* (the other copies are only wanted should a block of the first be bad) */
+	blocks_prefetch(file->blocks[0], first, last);
+	for (uint64_t j = first; j <= last && r; j++)
+	{
+		/* (a block in memory is either loaded or has changed since) */
+		if (j < data->chunks && data->chunk[j])
+			continue;
+		r = false;
+		for (unsigned i = 0; i < file_copies(file) && !r; i++)
+		{
+			if (i == 1)
+				replica_wait(file);
+			if (file->blocks[i][0] < j || !file->blocks[i][j])
+				continue;
+			if (!cipher_handle[i])
+				cipher_handle[i] = init_cipher(file, i);
+			cipher_seek(cipher_handle[i], file, i, j);
+			if (!block_read(file->blocks[i][j], &block, cipher_handle[i], file->path) || !tree_check(file, j, block.data))
+				continue;
+			uint64_t o = head_length() + (j - 1) * data_length();
+			data_write(data, block.data, stored_size(file) - o < data_length() ? stored_size(file) - o : data_length(), o);
+			r = true;
+		}
+	}
+	for (unsigned i = 0; i < file_copies(file); i++)
+		if (cipher_handle[i])
+			gcry_cipher_close(cipher_handle[i]);
+	if (!r)
+		return errno = EIO, false;
+	return true;
+}
+
 /*
  * block functions
  */
 
-static bool block_read(uint64_t bid, stegfs_block_s *block, gcry_cipher_hd_t cipher, const char * const restrict path)
+/*
+ * where each part of a block is, in room for one (of block_words())
+ */
+static block_s block_parts(uint64_t *raw)
+{
+	uint8_t *b = (uint8_t *)raw;
+	block_s block =
+	{
+		.path = raw,
+		.data = b + SIZE_BYTE_PATH,
+		.hash = (uint64_t *)(b + SIZE_BYTE_PATH + data_length()),
+		.next = (uint64_t *)(b + file_system.blocksize - SIZE_BYTE_NEXT)
+	};
+	return block;
+}
+
+static bool block_read(uint64_t bid, const block_s * const restrict block, gcry_cipher_hd_t cipher, const char * const restrict path)
 {
 	errno = EXIT_SUCCESS;
 	bid %= (file_system.size / file_system.blocksize);
 	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
 		return errno = EINVAL, false;
-	memcpy(block, file_system.memory + (bid * file_system.blocksize), sizeof( stegfs_block_s ));
+	/* a deleted block is as good as random, even if it isn’t yet */
+	if (__atomic_load_n(&file_system.blocks.shred[bid], __ATOMIC_RELAXED))
+		return false;
+	const uint8_t *source = file_system.memory + (bid * file_system.blocksize);
 	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
-	uint8_t *hash_buffer = m_gcry_malloc_secure(hash_length);
-	/* ignore path check in root */
+	uint8_t *hash_buffer = scratch_take(hash_length);
+	/* ignore path check in root; it’s checked where it is, before anything is copied */
 	if (!path_equals(path, DIR_SEPARATOR))
 	{
 		/* check path hash */
 		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, strlen(path));
-		if (memcmp(block->path, hash_buffer, hash_length))
+		if (memcmp(source, hash_buffer, path_length()))
 		{
-			gcry_free(hash_buffer);
+			scratch_give(hash_buffer);
 			return false;
 		}
 	}
+	memcpy(block->path, source, SIZE_BYTE_PATH);
+	if (block_sealed())
+	{
+		/*
+		 * the path is authenticated, and the data and next pointer
+		 * decrypted; the end of the data goes with the next pointer
+		 * so that all but the last part of the message is a whole
+		 * number of cipher blocks
+		 */
+		size_t bulk = data_length() - SIZE_BYTE_NEXT;
+		const uint8_t *hash = source + SIZE_BYTE_PATH + data_length();
+		uint8_t tail[SIZE_BYTE_NEXT * 2];
+		memcpy(tail, source + SIZE_BYTE_PATH + bulk, SIZE_BYTE_NEXT);
+		memcpy(tail + SIZE_BYTE_NEXT, hash + SIZE_BYTE_HASH, SIZE_BYTE_NEXT);
+		cipher_salt(cipher, hash + SIZE_BYTE_TAG);
+		gcry_cipher_authenticate(cipher, source, SIZE_BYTE_PATH);
+		gcry_cipher_decrypt(cipher, block->data, bulk, source + SIZE_BYTE_PATH, bulk);
+		gcry_cipher_final(cipher);
+		gcry_cipher_decrypt(cipher, tail, sizeof tail, NULL, 0);
+		memcpy(block->data + bulk, tail, SIZE_BYTE_NEXT);
+		memcpy(block->next, tail + SIZE_BYTE_NEXT, SIZE_BYTE_NEXT);
+		memcpy(block->hash, hash, SIZE_BYTE_HASH);
+		scratch_give(hash_buffer);
+		return gcry_err_code(gcry_cipher_checktag(cipher, hash, SIZE_BYTE_TAG)) == GPG_ERR_NO_ERROR;
+	}
+	if (block_tweaks())
+		cipher_salt(cipher, source + SIZE_BYTE_PATH - SIZE_BYTE_SALT);
+	source += SIZE_BYTE_PATH;
 #ifdef __DEBUG__
 	(void)cipher;
+	memcpy(block->data, source, file_system.blocksize - SIZE_BYTE_PATH);
 #else
-	/* decrypt block, but not the path */
-	void *ptr = block;
-	ptr += sizeof block->path;
-	gcry_cipher_decrypt(cipher, ptr, file_system.blocksize - sizeof block->path, NULL, 0);
+	/* decrypt straight out of the file system, but not the path */
+	gcry_cipher_decrypt(cipher, block->data, file_system.blocksize - SIZE_BYTE_PATH, source, file_system.blocksize - SIZE_BYTE_PATH);
 #endif
 	/* check data hash */
-	gcry_md_hash_buffer(file_system.hash, hash_buffer, block->data, sizeof block->data);
+	gcry_md_hash_buffer(file_system.hash, hash_buffer, block->data, data_length());
 	if (memcmp(block->hash, hash_buffer, hash_length))
 	{
-		gcry_free(hash_buffer);
-		return false;
+		scratch_give(hash_buffer);
+		return false;
+	}
+	scratch_give(hash_buffer);
+	return true;
+}
+
+/*
+ * fill in the path of a block from the hash of the file’s path (or NULL
+ * in the root directory); whatever the hash doesn’t cover is random,
+ * and so differs from block to block, and copy to copy
+ */
+static void block_path(const block_s * const restrict block, const uint8_t *path)
+{
+	size_t path_length = 0;
+	if (path)
+	{
+		size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
+		memcpy(block->path, path, path_length = (hash_length > SIZE_BYTE_PATH ? SIZE_BYTE_PATH : hash_length));
 	}
-	gcry_free(hash_buffer);
-	return true;
+	if (path_length < SIZE_BYTE_PATH)
+		random_fill((uint8_t *)block->path + path_length, SIZE_BYTE_PATH - path_length);
+	return;
+}
+
+/*
+ * fill in the hash of a block’s data (includes 0x00 after EOF), which is
+ * the same for every copy
+ */
+static void block_hash(const block_s * const restrict block)
+{
+	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
+	uint8_t *hash_buffer = scratch_take(hash_length);
+	gcry_md_hash_buffer(file_system.hash, hash_buffer, block->data, data_length());
+	memcpy(block->hash, hash_buffer, hash_length > SIZE_BYTE_HASH ? SIZE_BYTE_HASH : hash_length);
+	if (hash_length < SIZE_BYTE_HASH)
+		random_fill((uint8_t *)block->hash + hash_length, SIZE_BYTE_HASH - hash_length);
+	scratch_give(hash_buffer);
+	return;
 }
 
-static bool block_write(uint64_t bid, stegfs_block_s block, gcry_cipher_hd_t cipher, const char * const restrict path)
+/*
+ * write a block (with its path and hash filled in) into the file system;
+ * it’s encrypted straight into place, except for the path
+ */
+static bool block_encrypt(uint64_t bid, const block_s * const restrict block, gcry_cipher_hd_t cipher)
 {
 	errno = EXIT_SUCCESS;
 	bid %= (file_system.size / file_system.blocksize);
 	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
 		return errno = EINVAL, false;
-	gcry_create_nonce((void *)block.path, sizeof block.path);
-	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
-	uint8_t *hash_buffer = m_gcry_malloc_secure(hash_length);
-	if (!path_equals(path, DIR_SEPARATOR))
+	uint8_t *destination = file_system.memory + (bid * file_system.blocksize);
+	memcpy(destination, block->path, SIZE_BYTE_PATH);
+	if (block_sealed())
 	{
-		/* compute path hash */
-		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, strlen(path));
-		memcpy(block.path, hash_buffer, hash_length > sizeof block.path ? sizeof block.path : hash_length);
+		/*
+		 * sealed in one pass: the path is authenticated, the data
+		 * and next pointer encrypted (see block_read) and the tag
+		 * takes the place of the hash, followed by the salt of the
+		 * nonce, new for each write (see cipher_salt)
+		 */
+		size_t bulk = data_length() - SIZE_BYTE_NEXT;
+		uint8_t *hash = destination + SIZE_BYTE_PATH + data_length();
+		random_fill(hash + SIZE_BYTE_TAG, SIZE_BYTE_SALT);
+		cipher_salt(cipher, hash + SIZE_BYTE_TAG);
+		uint8_t tail[SIZE_BYTE_NEXT * 2];
+		memcpy(tail, block->data + bulk, SIZE_BYTE_NEXT);
+		memcpy(tail + SIZE_BYTE_NEXT, block->next, SIZE_BYTE_NEXT);
+		gcry_cipher_authenticate(cipher, destination, SIZE_BYTE_PATH);
+		gcry_cipher_encrypt(cipher, destination + SIZE_BYTE_PATH, bulk, block->data, bulk);
+		gcry_cipher_final(cipher);
+		gcry_cipher_encrypt(cipher, tail, sizeof tail, NULL, 0);
+		memcpy(destination + SIZE_BYTE_PATH + bulk, tail, SIZE_BYTE_NEXT);
+		memcpy(hash + SIZE_BYTE_HASH, tail + SIZE_BYTE_NEXT, SIZE_BYTE_NEXT);
+		gcry_cipher_gettag(cipher, hash, SIZE_BYTE_TAG);
+		return true;
+	}
+	/* a new salt, so that this write of the block has an IV of its own (in place of the end of its path) */
+	if (block_tweaks())
+	{
+		random_fill(destination + SIZE_BYTE_PATH - SIZE_BYTE_SALT, SIZE_BYTE_SALT);
+		cipher_salt(cipher, destination + SIZE_BYTE_PATH - SIZE_BYTE_SALT);
 	}
-	/* compute data hash (includes 0x00 after EOF) */
-	gcry_md_hash_buffer(file_system.hash, hash_buffer, block.data, sizeof block.data);
-	memcpy(block.hash, hash_buffer, hash_length > sizeof block.hash ? sizeof block.hash : hash_length);
-	gcry_free(hash_buffer);
+	destination += SIZE_BYTE_PATH;
 #ifdef __DEBUG__
 	(void)cipher;
+	memcpy(destination, block->data, file_system.blocksize - SIZE_BYTE_PATH);
 #else
-	/* encrypt the data, but not the path */
-	void *ptr = &block;
-	ptr += sizeof block.path;
-	gcry_cipher_encrypt(cipher, ptr, file_system.blocksize - sizeof block.path, NULL, 0);
+	gcry_cipher_encrypt(cipher, destination, file_system.blocksize - SIZE_BYTE_PATH, block->data, file_system.blocksize - SIZE_BYTE_PATH);
 #endif
 	/*
 	 * TODO: When ECC, sizeof block.data must be SIZE_BYTE_DATA
@@ -806,28 +3862,123 @@ static bool block_write(uint64_t bid, stegfs_block_s block, gcry_cipher_hd_t cip
 	 * 1,992 - 32 - 32 - 8 = 1,920 (capacity of FS block.data)
 	 */
 
-	memcpy(file_system.memory + (bid * file_system.blocksize), &block, sizeof block);
-	//msync(file_system.memory + (bid * file_system.blocksize), sizeof block, MS_SYNC);
+	//msync(file_system.memory + (bid * file_system.blocksize), file_system.blocksize, MS_SYNC);
 	return true;
 }
 
+/*
+ * the tag of a sealed block, straight out of the file system
+ */
+static const uint8_t *block_tag(uint64_t bid)
+{
+	return file_system.memory + normalize(bid) * file_system.blocksize + SIZE_BYTE_PATH + data_length();
+}
+
+/*
+ * free a block, and have it overwritten with random data; that’s done in
+ * the background unless the shredding thread can’t be started
+ */
 static void block_delete(uint64_t bid)
 {
 	bid %= (file_system.size / file_system.blocksize);
-	stegfs_block_s block;
-	memcpy(&block, file_system.memory + (bid * file_system.blocksize), sizeof block);
-	gcry_create_nonce(&block, file_system.blocksize);
 	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
 		return;
-	memcpy(file_system.memory + (bid * file_system.blocksize), &block, sizeof block);
-	//msync(file_system.memory + (bid * file_system.blocksize), sizeof block, MS_SYNC);
+	pthread_mutex_lock(&blocks_mutex);
+	file_system.blocks.shred[bid] = true;
+	pthread_mutex_unlock(&blocks_mutex);
+	block_release(bid);
+	if (!shred_queue(bid))
+		block_shred(bid);
+	return;
+}
+
+/*
+ * overwrite a deleted block with random data, unless it’s been given to
+ * another file since
+ */
+static void block_shred(uint64_t bid)
+{
+	pthread_mutex_lock(&blocks_mutex);
+	if (file_system.blocks.shred[bid])
+	{
+		random_fill(file_system.memory + (bid * file_system.blocksize), file_system.blocksize);
+		//msync(file_system.memory + (bid * file_system.blocksize), file_system.blocksize, MS_SYNC);
+		file_system.blocks.shred[bid] = false;
+	}
+	pthread_mutex_unlock(&blocks_mutex);
+	return;
+}
+
+/*
+ * give back a block which was assigned but never written to
+ */
+static void block_release(uint64_t bid)
+{
+	if (file_system.read_only)
+		return;
+	bid = normalize(bid);
+	pthread_mutex_lock(&blocks_mutex);
 	file_system.blocks.in_use[bid] = false;
 	if (file_system.show_bloc)
 	{
 		free(file_system.blocks.file[bid]);
 		file_system.blocks.file[bid] = NULL;
 	}
-	file_system.blocks.used--;
+	__atomic_sub_fetch(&file_system.blocks.used, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&blocks_mutex);
+	return;
+}
+
+/*
+ * note that a block is used by the given file; it’s only counted once,
+ * however many times the file is stat’d (and not at all when read-only,
+ * as nothing will be allocated, so stat needn’t wait on the lock)
+ */
+static void block_mark(uint64_t bid, const stegfs_file_s * const restrict file)
+{
+	if (file_system.read_only)
+		return;
+	bid = normalize(bid);
+	pthread_mutex_lock(&blocks_mutex);
+	if (file_system.show_bloc)
+		m_asprintf(&file_system.blocks.file[bid], "../%s/%s", file->path, file->name);
+	file_system.blocks.shred[bid] = false;
+	if (!file_system.blocks.in_use[bid])
+	{
+		file_system.blocks.in_use[bid] = true;
+		__atomic_add_fetch(&file_system.blocks.used, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&blocks_mutex);
+	return;
+}
+
+/*
+ * ask for a block to be read in now, so that it’s (more likely) there
+ * when it’s needed; as the file system is mapped for random access,
+ * otherwise each block is only read once it’s touched
+ */
+static void block_prefetch(uint64_t bid)
+{
+	bid %= (file_system.size / file_system.blocksize);
+	if (!bid)
+		return;
+	uintptr_t start = (uintptr_t)(file_system.memory + (bid * file_system.blocksize));
+	uintptr_t end = start + file_system.blocksize;
+	start &= ~(uintptr_t)(page_size - 1);
+	madvise((void *)start, end - start, MADV_WILLNEED);
+	return;
+}
+
+/*
+ * likewise the given range of a list of blocks (as in a copy of a file),
+ * as far as it’s known
+ */
+static void blocks_prefetch(const uint64_t *list, uint64_t first, uint64_t last)
+{
+	if (!list)
+		return;
+	for (uint64_t i = first ? : 1; i <= last && i <= list[0] && list[i]; i++)
+		block_prefetch(list[i]);
 	return;
 }
 
@@ -841,13 +3992,16 @@ static bool block_in_use(uint64_t bid, const char * const restrict path)
 	 */
 	if (file_system.blocks.in_use[bid])
 		return true;
+	/* a deleted block might still look like it belongs to someone */
+	if (file_system.blocks.shred[bid])
+		return false;
 	/*
 	 * block not found in cache; check if this might belong to a file
 	 * in this directory, or any parent directory
 	 */
 #ifndef __DEBUG__
 	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
-	uint8_t *hash_buffer = m_gcry_malloc_secure(hash_length);
+	uint8_t *hash_buffer = scratch_take(hash_length);
 	char *p = NULL;
 	uint16_t hierarchy = dir_get_deep(path);
 	for (uint16_t i = 1; i < hierarchy; i++)
@@ -857,20 +4011,21 @@ static bool block_in_use(uint64_t bid, const char * const restrict path)
 		if (e)
 			free(e);
 		gcry_md_hash_buffer(file_system.hash, hash_buffer, p, strlen(p));
-		if (!memcmp(hash_buffer, file_system.memory + (bid * file_system.blocksize), hash_length))
+		if (!memcmp(hash_buffer, file_system.memory + (bid * file_system.blocksize), path_length()))
 		{
-			gcry_free(hash_buffer);
+			free(p);
+			scratch_give(hash_buffer);
 			/*
 			 * block detected as being used by a file that exists
 			 * closer to the root of the system; mark it as such
 			 */
 			file_system.blocks.in_use[bid] = true;
-			file_system.blocks.used++;
+			__atomic_add_fetch(&file_system.blocks.used, 1, __ATOMIC_RELAXED);
 			return true;
 		}
 	}
 	free(p);
-	gcry_free(hash_buffer);
+	scratch_give(hash_buffer);
 #else
 	(void)path;
 #endif
@@ -888,16 +4043,22 @@ static uint64_t block_assign(const char * const restrict path)
 {
 	uint64_t block;
 	uint64_t tries = 0;
+	pthread_mutex_lock(&blocks_mutex);
 	do
 	{
 		block = (lrand48() << 32 | lrand48());// % (file_system.size / file_system.blocksize);
 		/* eventually “timeout” after trying as many blocks as exists */
 		if ((++tries) > file_system.size / file_system.blocksize)
+		{
+			pthread_mutex_unlock(&blocks_mutex);
 			return 0;
+		}
 	}
 	while (block_in_use(block, path));
 	file_system.blocks.in_use[normalize(block)] = true;
-	file_system.blocks.used++;
+	file_system.blocks.shred[normalize(block)] = false;
+	__atomic_add_fetch(&file_system.blocks.used, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&blocks_mutex);
 	return block;
 }
 
@@ -915,7 +4076,7 @@ static gcry_cipher_hd_t init_cipher(const stegfs_file_s * const restrict file, u
 	/* create the initial key for the encryption algorithm */
 	size_t key_length = gcry_cipher_get_algo_keylen(file_system.cipher);
 	/* allocate space for whichever is larger */
-	uint8_t *key_data = m_gcry_calloc_secure(key_length > hash_length ? key_length : hash_length, sizeof( uint8_t ));
+	uint8_t *key_data = scratch_take(key_length > hash_length ? key_length : hash_length);
 	if (file_system.version < VERSION_202X_XX)
 	{
 		gcry_md_write(hash, file->path, strlen(file->path));
@@ -940,13 +4101,26 @@ static gcry_cipher_hd_t init_cipher(const stegfs_file_s * const restrict file, u
 		gcry_kdf_derive(hash_data, hash_length, GCRY_KDF_PBKDF2, file_system.hash, salt_data, salt_length, file_system.kdf_iterations, key_length, key_data);
 	}
 	gcry_cipher_setkey(cipher, key_data, key_length);
-	gcry_free(key_data);
+	scratch_give(key_data);
 	gcry_md_close(salt);
-	/* create the iv for the encryption algorithm */
-	gcry_md_reset(hash);
+	gcry_md_close(hash);
+	cipher_seek(cipher, file, ivi, 0);
+	return cipher;
+}
+
+/*
+ * set the IV for the given copy of a file; the key (which is the same
+ * for every copy, and is expensive to derive) is kept
+ */
+static void cipher_restart(gcry_cipher_hd_t cipher, const stegfs_file_s * const restrict file, uint8_t ivi)
+{
+	gcry_cipher_reset(cipher);
+	gcry_md_hd_t hash;
+	gcry_md_open(&hash, file_system.hash, GCRY_MD_FLAG_SECURE);
+	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
 	size_t iv_length = gcry_cipher_get_algo_blklen(file_system.cipher);
 	/* allocate space for whichever is larger */
-	uint8_t *iv = m_gcry_calloc_secure(iv_length > hash_length ? iv_length : hash_length, sizeof( uint8_t ));
+	uint8_t *iv = scratch_take(iv_length > hash_length ? iv_length : hash_length);
 	if (file->pass)
 		gcry_md_write(hash, file->pass, strlen(file->pass));
 	else
@@ -956,23 +4130,89 @@ static gcry_cipher_hd_t init_cipher(const stegfs_file_s * const restrict file, u
 	gcry_md_write(hash, &ivi, sizeof ivi);
 	memcpy(iv, gcry_md_read(hash, file_system.hash), iv_length);
 	gcry_cipher_setiv(cipher, iv, iv_length);
+	scratch_give(iv);
 	gcry_md_close(hash);
-	return cipher;
+	return;
 }
 
-static gcry_mac_hd_t init_mac(const stegfs_file_s * const restrict file, uint8_t ivi)
+/*
+ * ready the cipher for block n (0 being the inode) of the given copy of
+ * a file; where blocks are encrypted on their own each has its own IV
+ * (or counter), otherwise the chain carries on from the block before
+ */
+static void cipher_seek(gcry_cipher_hd_t cipher, const stegfs_file_s * const restrict file, uint8_t ivi, uint64_t n)
+{
+	if (!block_tweaks())
+	{
+		if (!n)
+			cipher_restart(cipher, file, ivi);
+		return;
+	}
+	gcry_cipher_reset(cipher);
+	gcry_md_hd_t hash;
+	gcry_md_open(&hash, file_system.hash, GCRY_MD_FLAG_SECURE);
+	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
+	size_t iv_length = block_sealed() ? SIZE_BYTE_NONCE : gcry_cipher_get_algo_blklen(file_system.cipher);
+	uint8_t *iv = scratch_take(iv_length > hash_length ? iv_length : hash_length);
+	if (file->pass)
+		gcry_md_write(hash, file->pass, strlen(file->pass));
+	else
+		gcry_md_write(hash, "", strlen(""));
+	gcry_md_write(hash, file->name, strlen(file->name));
+	gcry_md_write(hash, file->path, strlen(file->path));
+	gcry_md_write(hash, &ivi, sizeof ivi);
+	uint64_t tweak = htonll(n);
+	gcry_md_write(hash, &tweak, sizeof tweak);
+	memcpy(iv, gcry_md_read(hash, file_system.hash), iv_length);
+	/* setting the IV doesn’t move the counter */
+	if (file_system.mode == GCRY_CIPHER_MODE_CTR)
+		gcry_cipher_setctr(cipher, iv, iv_length);
+	else
+		gcry_cipher_setiv(cipher, iv, iv_length);
+	scratch_give(iv);
+	gcry_md_close(hash);
+	return;
+}
+
+/*
+ * move the cipher on from the IV (or nonce) cipher_seek gave a block to
+ * that of one write of it: the hash of what encrypting 0’s with the
+ * block’s IV gives (which takes the key) and the salt stored with the
+ * block; as the salt is new each time the block is written, a block
+ * rewritten in place (as when only part of a file changes) never reuses
+ * an IV, or keystream
+ */
+static void cipher_salt(gcry_cipher_hd_t cipher, const uint8_t *salt)
+{
+	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
+	size_t iv_length = block_sealed() ? SIZE_BYTE_NONCE : gcry_cipher_get_algo_blklen(file_system.cipher);
+	uint8_t *secret = scratch_take(SIZE_BYTE_SALT);
+	gcry_cipher_encrypt(cipher, secret, SIZE_BYTE_SALT, NULL, 0);
+	gcry_cipher_reset(cipher);
+	gcry_md_hd_t hash;
+	gcry_md_open(&hash, file_system.hash, GCRY_MD_FLAG_SECURE);
+	gcry_md_write(hash, secret, SIZE_BYTE_SALT);
+	gcry_md_write(hash, salt, SIZE_BYTE_SALT);
+	uint8_t *iv = scratch_take(iv_length > hash_length ? iv_length : hash_length);
+	memcpy(iv, gcry_md_read(hash, file_system.hash), iv_length);
+	if (file_system.mode == GCRY_CIPHER_MODE_CTR)
+		gcry_cipher_setctr(cipher, iv, iv_length);
+	else
+		gcry_cipher_setiv(cipher, iv, iv_length);
+	gcry_md_close(hash);
+	scratch_give(iv);
+	scratch_give(secret);
+	return;
+}
+
+static void mac_key(const stegfs_file_s * const restrict file, uint8_t *key, size_t length)
 {
-	/* obtain handles */
-	gcry_mac_hd_t mac;
-	gcry_mac_open(&mac, file_system.mac, GCRY_MAC_FLAG_SECURE, NULL);
-	size_t mac_key_length = gcry_mac_get_algo_keylen(file_system.mac);
 	gcry_md_hd_t hash;
 	gcry_md_open(&hash, file_system.hash, GCRY_MD_FLAG_SECURE);
 	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
 	gcry_md_hd_t salt;
 	gcry_md_open(&salt, file_system.hash, GCRY_MD_FLAG_SECURE);
 	size_t salt_length = gcry_md_get_algo_dlen(file_system.hash);
-	/* allocate space for whichever is larger */
 	gcry_md_write(hash, file->name, strlen(file->name));
 	if (file->pass)
 		gcry_md_write(hash, file->pass, strlen(file->pass));
@@ -982,17 +4222,30 @@ static gcry_mac_hd_t init_mac(const stegfs_file_s * const restrict file, uint8_t
 	gcry_md_write(salt, file->path, strlen(file->path));
 	const uint8_t *hash_data = gcry_md_read(hash, file_system.hash);
 	const uint8_t *salt_data = gcry_md_read(salt, file_system.hash);
+	gcry_kdf_derive(hash_data, hash_length, GCRY_KDF_PBKDF2, file_system.hash, salt_data, salt_length, file_system.kdf_iterations, length, key);
+	gcry_md_close(salt);
+	gcry_md_close(hash);
+	return;
+}
+
+static gcry_mac_hd_t init_mac(const stegfs_file_s * const restrict file, uint8_t ivi)
+{
+	/* obtain handles */
+	gcry_mac_hd_t mac;
+	gcry_mac_open(&mac, file_system.mac, GCRY_MAC_FLAG_SECURE, NULL);
+	size_t mac_key_length = gcry_mac_get_algo_keylen(file_system.mac);
+	gcry_md_hd_t hash;
+	gcry_md_open(&hash, file_system.hash, GCRY_MD_FLAG_SECURE);
+	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
 	/* initialise the mac */
-	uint8_t *mac_key_data = m_gcry_calloc_secure(mac_key_length, sizeof( byte_t ));
-	gcry_kdf_derive(hash_data, hash_length, GCRY_KDF_PBKDF2, file_system.hash, salt_data, salt_length, file_system.kdf_iterations, mac_key_length, mac_key_data);
+	uint8_t *mac_key_data = scratch_take(mac_key_length);
+	mac_key(file, mac_key_data, mac_key_length);
 	gcry_mac_setkey(mac, mac_key_data, mac_key_length);
-	gcry_free(mac_key_data);
-	gcry_md_close(salt);
+	scratch_give(mac_key_data);
 	/* create the iv for the encryption algorithm */
-	gcry_md_reset(hash);
 	size_t iv_length = gcry_cipher_get_algo_blklen(file_system.cipher);
 	/* allocate space for whichever is larger */
-	uint8_t *iv = m_gcry_calloc_secure(iv_length > hash_length ? iv_length : hash_length, sizeof( uint8_t ));
+	uint8_t *iv = scratch_take(iv_length > hash_length ? iv_length : hash_length);
 	if (file->pass)
 		gcry_md_write(hash, file->pass, strlen(file->pass));
 	else
@@ -1004,14 +4257,241 @@ static gcry_mac_hd_t init_mac(const stegfs_file_s * const restrict file, uint8_t
 	const char *mac_name = mac_name_from_id(file_system.mac);
 	if (!strncmp("GMAC", mac_name, strlen("GMAC")) || !strncmp("POLY1305", mac_name, strlen("POLY1305")))
 		gcry_mac_setiv(mac, iv, iv_length);
+	scratch_give(iv);
 	gcry_md_close(hash);
 	return mac;
 }
 
+/*
+ * the message digest an HMAC is built on (or none if the MAC isn’t an
+ * HMAC)
+ */
+static enum gcry_md_algos hmac_algo(void)
+{
+	switch (file_system.mac)
+	{
+		case GCRY_MAC_HMAC_SHA256:
+			return GCRY_MD_SHA256;
+		case GCRY_MAC_HMAC_SHA224:
+			return GCRY_MD_SHA224;
+		case GCRY_MAC_HMAC_SHA512:
+			return GCRY_MD_SHA512;
+		case GCRY_MAC_HMAC_SHA384:
+			return GCRY_MD_SHA384;
+		case GCRY_MAC_HMAC_SHA1:
+			return GCRY_MD_SHA1;
+		case GCRY_MAC_HMAC_MD5:
+			return GCRY_MD_MD5;
+		case GCRY_MAC_HMAC_RMD160:
+			return GCRY_MD_RMD160;
+		case GCRY_MAC_HMAC_TIGER1:
+			return GCRY_MD_TIGER1;
+		case GCRY_MAC_HMAC_WHIRLPOOL:
+			return GCRY_MD_WHIRLPOOL;
+		case GCRY_MAC_HMAC_STRIBOG256:
+			return GCRY_MD_STRIBOG256;
+		case GCRY_MAC_HMAC_STRIBOG512:
+			return GCRY_MD_STRIBOG512;
+		case GCRY_MAC_HMAC_SHA3_224:
+			return GCRY_MD_SHA3_224;
+		case GCRY_MAC_HMAC_SHA3_256:
+			return GCRY_MD_SHA3_256;
+		case GCRY_MAC_HMAC_SHA3_384:
+			return GCRY_MD_SHA3_384;
+		case GCRY_MAC_HMAC_SHA3_512:
+			return GCRY_MD_SHA3_512;
+		default:
+			return GCRY_MD_NONE;
+	}
+}
+
+/*
+ * start the MAC of a file’s data; if the state of the MAC was saved at
+ * a block before from then carry on from there, and update from to be
+ * the first block that still needs adding
+ */
+static file_mac_s file_mac_open(const stegfs_file_s * const restrict file, uint64_t *from)
+{
+	file_mac_s mac = { NULL, NULL };
+	enum gcry_md_algos algo = hmac_algo();
+	if (algo == GCRY_MD_NONE)
+	{
+		*from = 1;
+		mac.mac = init_mac(file, 0);
+		return mac;
+	}
+	if (file->mac_state && file->mac_blocks < *from)
+	{
+		gcry_md_copy(&mac.hmac, file->mac_state);
+		*from = file->mac_blocks + 1;
+		return mac;
+	}
+	*from = 1;
+	gcry_md_open(&mac.hmac, algo, GCRY_MD_FLAG_SECURE | GCRY_MD_FLAG_HMAC);
+	size_t mac_key_length = gcry_mac_get_algo_keylen(file_system.mac);
+	uint8_t *mac_key_data = scratch_take(mac_key_length);
+	mac_key(file, mac_key_data, mac_key_length);
+	gcry_md_setkey(mac.hmac, mac_key_data, mac_key_length);
+	scratch_give(mac_key_data);
+	return mac;
+}
+
+static void file_mac_write(file_mac_s *mac, const void *data, size_t length)
+{
+	if (mac->hmac)
+		gcry_md_write(mac->hmac, data, length);
+	else
+		gcry_mac_write(mac->mac, data, length);
+	return;
+}
+
+/*
+ * remember the state of the MAC after the given number of blocks, so
+ * that appending to the file doesn’t need all of its data again
+ */
+static void file_mac_save(file_mac_s *mac, stegfs_file_s *file, uint64_t blocks)
+{
+	if (!mac->hmac)
+		return;
+	if (file->mac_state)
+		gcry_md_close(file->mac_state);
+	gcry_md_copy(&file->mac_state, mac->hmac);
+	file->mac_blocks = blocks;
+	return;
+}
+
+static void file_mac_read(file_mac_s *mac, uint8_t *data, size_t *length)
+{
+	if (mac->hmac)
+		memcpy(data, gcry_md_read(mac->hmac, 0), *length);
+	else
+		gcry_mac_read(mac->mac, data, length);
+	return;
+}
+
+static bool file_mac_verify(file_mac_s *mac, const uint8_t *data, size_t length)
+{
+	if (mac->hmac)
+		return !memcmp(gcry_md_read(mac->hmac, 0), data, length);
+	return gcry_err_code(gcry_mac_verify(mac->mac, data, length)) != GPG_ERR_CHECKSUM;
+}
+
+static void file_mac_close(file_mac_s *mac)
+{
+	if (mac->hmac)
+		gcry_md_close(mac->hmac);
+	if (mac->mac)
+		gcry_mac_close(mac->mac);
+	mac->hmac = NULL;
+	mac->mac = NULL;
+	return;
+}
+
+/*
+ * the MAC of a sealed copy of a file, which is of the tags of its blocks
+ * (in order) rather than of its data
+ */
+static void file_mac_tags(const stegfs_file_s * const restrict file, unsigned copy, uint8_t *data)
+{
+	uint64_t blocks = data_blocks(stored_size(file));
+	uint64_t m = 1;
+	file_mac_s mac = file_mac_open(file, &m);
+	for (uint64_t j = 1; j <= blocks; j++)
+		file_mac_write(&mac, block_tag(file->blocks[copy][j]), SIZE_BYTE_TAG);
+	size_t length = gcry_mac_get_algo_maclen(file_system.mac);
+	file_mac_read(&mac, data, &length);
+	file_mac_close(&mac);
+	return;
+}
+
+/*
+ * whether a cipher can carry on part way along a chain; always possible
+ * when each block is encrypted on its own, otherwise only for modes
+ * where the state is no more than the previous cipher block
+ */
+static bool cipher_resumable(void)
+{
+	if (block_tweaks())
+		return true;
+#ifdef __DEBUG__
+	return true;
+#else
+	switch (file_system.mode)
+	{
+		case GCRY_CIPHER_MODE_ECB:
+		case GCRY_CIPHER_MODE_CBC:
+		case GCRY_CIPHER_MODE_CFB:
+			return true;
+		default:
+			return false;
+	}
+#endif
+}
+
+/*
+ * ready a cipher to carry on from the end of block n-1 of a chain, using
+ * the cipher text that’s already on disk
+ */
+static bool cipher_resume(gcry_cipher_hd_t cipher, const stegfs_file_s * const restrict file, uint8_t copy, uint64_t n)
+{
+	if (n <= 1 || block_tweaks())
+		return true;
+	if (!cipher_resumable())
+		return false;
+#ifdef __DEBUG__
+	(void)cipher;
+	(void)file;
+	(void)copy;
+#else
+	if (file_system.mode != GCRY_CIPHER_MODE_ECB)
+	{
+		size_t iv_length = gcry_cipher_get_algo_blklen(file_system.cipher);
+		uint64_t bid = normalize(file->blocks[copy][n - 1]);
+		gcry_cipher_setiv(cipher, file_system.memory + (bid + 1) * file_system.blocksize - iv_length, iv_length);
+	}
+#endif
+	return true;
+}
+
 /*
  * cache functions
  */
 
+/*
+ * add an entry to a directory in the cache; when read-only the cache is
+ * searched without the lock, so instead of reallocating (and so perhaps
+ * moving) the directory’s entries, they’re copied to a bigger array, which
+ * is swapped in before the count is; the old array is kept (see retired)
+ */
+static void cache_link(stegfs_cache_s *dir, stegfs_cache_s *entry)
+{
+	if (!file_system.read_only)
+	{
+		/* use existing, NULL entry in array if available */
+		for (uint64_t i = 0; i < dir->ents; i++)
+			if (!dir->child[i]->name)
+			{
+				dir->child[i] = entry;
+				return;
+			}
+		dir->child = m_realloc(dir->child, (dir->ents + 1) * sizeof( stegfs_cache_s * ));
+		dir->child[dir->ents++] = entry;
+		return;
+	}
+	stegfs_cache_s **child = m_malloc((dir->ents + 1) * sizeof( stegfs_cache_s * ));
+	if (dir->ents)
+		memcpy(child, dir->child, dir->ents * sizeof( stegfs_cache_s * ));
+	child[dir->ents] = entry;
+	if (dir->child)
+	{
+		retired.arrays = m_realloc(retired.arrays, (retired.count + 1) * sizeof( stegfs_cache_s ** ));
+		retired.arrays[retired.count++] = dir->child;
+	}
+	__atomic_store_n(&dir->child, child, __ATOMIC_RELEASE);
+	__atomic_store_n(&dir->ents, dir->ents + 1, __ATOMIC_RELEASE);
+	return;
+}
+
 /*
  * add path (directory) or file to the cache; if adding a file, the path
  * can be null as it will be taken from the file object
@@ -1019,11 +4499,14 @@ static gcry_mac_hd_t init_mac(const stegfs_file_s * const restrict file, uint8_t
 extern void stegfs_cache_add(const char * const restrict path, stegfs_file_s *file)
 {
 	stegfs_cache_s *ptr = NULL;//&(file_system.cache);
+	stegfs_cache_s *parent = NULL;
+	stegfs_cache_s *entry = NULL;
 	char *p = NULL;
 	if (path)
 		p = m_strdup(path);
 	else
 		p = m_strdupf("%s/%s", path_equals(file->path, DIR_SEPARATOR) ? "" : file->path, file->name);
+	pthread_mutex_lock(&cache_mutex);
 	if ((ptr = stegfs_cache_exists(p, NULL)))
 		goto c2a3; /* already in cache */
 
@@ -1043,77 +4526,87 @@ extern void stegfs_cache_add(const char * const restrict path, stegfs_file_s *fi
 			}
 		if (!found)
 		{
-			/*
-			 * use existing, NULL entry in array if available
-			 */
-			uint64_t k = ptr->ents;
-			for (uint64_t j = 0; j < ptr->ents; j++)
-				if (!ptr->child[j]->name)
-				{
-					k = j;
-					goto c2a1;
-				}
-			ptr->child = m_realloc(ptr->child, (k + 1) * sizeof(stegfs_cache_s *));
-			ptr->ents++;
-c2a1:
-			ptr->child[k] = m_calloc(sizeof( stegfs_cache_s ), sizeof( uint8_t ));
-			ptr->child[k]->name = m_strdup(e);
-			ptr = ptr->child[k];
+			stegfs_cache_s *d = m_calloc(sizeof( stegfs_cache_s ), sizeof( uint8_t ));
+			d->name = m_strdup(e);
+			cache_link(ptr, d);
+			ptr = d;
 		}
 		free(e);
 	}
-	/* ditto */
-	uint64_t j = ptr->ents;
-	for (uint64_t i = 0; i < ptr->ents; i++)
-		if (!ptr->child[i]->name)
-		{
-			j = i;
-			goto c2a2;
-		}
-	ptr->child = m_realloc(ptr->child, (j + 1) * sizeof(stegfs_cache_s *));
-	ptr->ents++;
-c2a2:
-	ptr->child[j] = m_calloc(sizeof( stegfs_cache_s ), sizeof( uint8_t ));
-	ptr = ptr->child[j];
+	/* the new entry is only added to its directory once it’s complete */
+	parent = ptr;
+	ptr = entry = m_calloc(sizeof( stegfs_cache_s ), sizeof( uint8_t ));
 	ptr->name = name;
 c2a3:
-	if (file && file != ptr->file)
+	/* when read-only, someone might be reading a cached file without the lock */
+	if (file && file != ptr->file && !(file_system.read_only && ptr->file))
 	{
-		if (!ptr->file)
-			ptr->file = m_calloc(sizeof( stegfs_file_s ), sizeof( uint8_t ));
+		stegfs_file_s *f = ptr->file ? : m_calloc(sizeof( stegfs_file_s ), sizeof( uint8_t ));
 		/* set path and name */
-		m_asprintf(&ptr->file->path, "%s", file->path);
-		m_asprintf(&ptr->file->name, "%s", file->name);
-		m_asprintf(&ptr->file->pass, "%s", file->pass);
-		/* set inodes */
-		for (unsigned i = 0; i < file_system.copies; i++)
-			ptr->file->inodes[i] = file->inodes[i];
+		m_asprintf(&f->path, "%s", file->path);
+		m_asprintf(&f->name, "%s", file->name);
+		m_asprintf(&f->pass, "%s", file->pass);
+		/* set inodes (if known; they aren’t until the file is stat’d) */
+		for (unsigned i = 0; i < file_system.copies && file->inodes[0]; i++)
+			f->inodes[i] = file->inodes[i];
 		/* set time and size */
-		ptr->file->write = file->write;
-		ptr->file->time = file->time;
-		ptr->file->size = file->size;
-		if (ptr->file->size)
+		f->write = file->write;
+		f->time = file->time;
+		f->size = file->size;
+		f->stored = file->stored;
+		f->compressed = file->compressed;
+		f->dirty = file->dirty;
+		f->dirty_end = file->dirty_end;
+		f->copies = file->copies;
+		if (f->size)
 		{
-			/* copy data */
-			if (file->data)
-			{
-				ptr->file->data = m_realloc(ptr->file->data, ptr->file->size);
-				memcpy(ptr->file->data, file->data, ptr->file->size);
-			}
+			/* copy data (and as it’s stored, if compressed) */
+			if (file->data.chunks)
+				data_copy(&f->data, &file->data);
+			if (file->packed.chunks)
+				data_copy(&f->packed, &file->packed);
+			else
+				data_truncate(&f->packed, 0);
 			/* copy blocks */
-			stegfs_block_s block;
-			lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-			uint64_t blocks = d.quot + (d.rem > 0);
-			for (unsigned i = 0; i < file_system.copies; i++)
+			uint64_t blocks = chain_blocks(stored_size(file));
+			for (unsigned i = 0; i < file_copies(file); i++)
 			{
-				ptr->file->blocks[i] = m_realloc(ptr->file->blocks[i], (blocks + 1) * sizeof blocks);
-				//memset(ptr->file->blocks[i], 0x00, blocks * sizeof blocks);
-				ptr->file->blocks[i][0] = blocks;
+				f->blocks[i] = m_realloc(f->blocks[i], (blocks + 2) * sizeof blocks);
+				memset(f->blocks[i], 0x00, (blocks + 2) * sizeof blocks);
+				f->blocks[i][0] = blocks;
 				for (uint64_t j = 1 ; j <= blocks && file->blocks[i] && file->blocks[i][j]; j++)
-					ptr->file->blocks[i][j] = file->blocks[i][j];
+					f->blocks[i][j] = file->blocks[i][j];
+				if (file->index[i])
+				{
+					f->index[i] = m_realloc(f->index[i], (file->index[i][0] + 1) * sizeof blocks);
+					memcpy(f->index[i], file->index[i], (file->index[i][0] + 1) * sizeof blocks);
+				}
+			}
+			for (unsigned i = file_copies(file); i < file_system.copies; i++)
+			{
+				free(f->blocks[i]);
+				f->blocks[i] = NULL;
+				free(f->index[i]);
+				f->index[i] = NULL;
+			}
+			f->listed = file->listed;
+			/* and the hash tree */
+			free(f->tree);
+			f->tree = NULL;
+			if (file->tree)
+			{
+				f->tree = m_malloc(tree_nodes(file->tree_leaves) * node_length());
+				memcpy(f->tree, file->tree, tree_nodes(file->tree_leaves) * node_length());
 			}
+			f->tree_leaves = file->tree_leaves;
+			f->tree_dirty = file->tree_dirty;
+			f->tree_dirty_end = file->tree_dirty_end;
 		}
+		__atomic_store_n(&ptr->file, f, __ATOMIC_RELEASE);
 	}
+	if (entry)
+		cache_link(parent, entry);
+	pthread_mutex_unlock(&cache_mutex);
 	free(p);
 //	if (name)
 //		free(name);
@@ -1129,14 +4622,19 @@ extern stegfs_cache_s *stegfs_cache_exists(const char * const restrict path, ste
 	stegfs_cache_s *ptr = &(file_system.cache);
 	char *name = dir_get_name(path, PASSWORD_SEPARATOR);
 	uint16_t hierarchy = dir_get_deep(path);
+	/* when read-only entries are only ever added, and never changed once they have been */
+	if (!file_system.read_only)
+		pthread_mutex_lock(&cache_mutex);
 	for (uint16_t i = 1; i < hierarchy; i++)
 	{
 		bool found = false;
 		char *e = dir_get_part(path, i);
-		for (uint64_t j = 0; j < ptr->ents; j++)
-			if (ptr->child[j]->name && !strcmp(ptr->child[j]->name, e))
+		uint64_t ents = __atomic_load_n(&ptr->ents, __ATOMIC_ACQUIRE);
+		stegfs_cache_s **child = __atomic_load_n(&ptr->child, __ATOMIC_ACQUIRE);
+		for (uint64_t j = 0; j < ents; j++)
+			if (child[j]->name && !strcmp(child[j]->name, e))
 			{
-				ptr = ptr->child[j];
+				ptr = child[j];
 				found = true;
 				break;
 			}
@@ -1144,15 +4642,27 @@ extern stegfs_cache_s *stegfs_cache_exists(const char * const restrict path, ste
 		if (!found)
 			goto done;
 	}
-	for (uint64_t i = 0; i < ptr->ents; i++)
-		if (ptr->child[i]->name && !strcmp(ptr->child[i]->name, name))
+	uint64_t ents = __atomic_load_n(&ptr->ents, __ATOMIC_ACQUIRE);
+	stegfs_cache_s **child = __atomic_load_n(&ptr->child, __ATOMIC_ACQUIRE);
+	for (uint64_t i = 0; i < ents; i++)
+		if (child[i]->name && !strcmp(child[i]->name, name))
 		{
 			free(name);
 			if (entry)
-				memcpy(entry, ptr->child[i], sizeof( stegfs_cache_s ));
-			return ptr->child[i];
+			{
+				memcpy(entry, child[i], sizeof( stegfs_cache_s ));
+				/* (the number of entries first, as there might since be more) */
+				entry->ents = __atomic_load_n(&child[i]->ents, __ATOMIC_ACQUIRE);
+				entry->child = __atomic_load_n(&child[i]->child, __ATOMIC_ACQUIRE);
+				entry->file = __atomic_load_n(&child[i]->file, __ATOMIC_ACQUIRE);
+			}
+			if (!file_system.read_only)
+				pthread_mutex_unlock(&cache_mutex);
+			return child[i];
 		}
 done:
+	if (!file_system.read_only)
+		pthread_mutex_unlock(&cache_mutex);
 	if (name)
 		free(name);
 	return NULL;
@@ -1163,6 +4673,7 @@ extern void stegfs_cache_remove(const char * const restrict path)
 	stegfs_cache_s *ptr = &(file_system.cache);
 	char *name = dir_get_name(path, PASSWORD_SEPARATOR);
 	uint16_t hierarchy = dir_get_deep(path);
+	pthread_mutex_lock(&cache_mutex);
 	for (uint16_t i = 1; i < hierarchy; i++)
 	{
 		bool found = false;
@@ -1193,13 +4704,27 @@ extern void stegfs_cache_remove(const char * const restrict path)
 		free(ptr->file->path);
 		free(ptr->file->name);
 		free(ptr->file->pass);
-		if (ptr->file->data)
-			free(ptr->file->data);
+		stegfs_data_truncate(ptr->file, 0);
+		data_truncate(&ptr->file->packed, 0);
+		if (ptr->file->mac_state)
+			gcry_md_close(ptr->file->mac_state);
+		free(ptr->file->tree);
+		file_unreserve(ptr->file);
+		uint64_t blocks = chain_blocks(stored_size(ptr->file));
 		for (unsigned i = 0; i < file_system.copies; i++)
 			if (ptr->file->blocks[i])
 			{
+				/* give back blocks reserved beyond the end of the file */
+				for (uint64_t j = blocks + 1; j <= ptr->file->blocks[i][0]; j++)
+					if (ptr->file->blocks[i][j] && file_system.blocks.in_use[normalize(ptr->file->blocks[i][j])])
+						block_release(ptr->file->blocks[i][j]);
+				for (uint64_t j = index_blocks(blocks) + 1; ptr->file->index[i] && j <= ptr->file->index[i][0]; j++)
+					if (ptr->file->index[i][j] && file_system.blocks.in_use[normalize(ptr->file->index[i][j])])
+						block_release(ptr->file->index[i][j]);
 				free(ptr->file->blocks[i]);
 				ptr->file->blocks[i] = NULL;
+				free(ptr->file->index[i]);
+				ptr->file->index[i] = NULL;
 			}
 		free(ptr->file);
 	}
@@ -1217,6 +4742,7 @@ extern void stegfs_cache_remove(const char * const restrict path)
 	free(ptr->name);
 	ptr->name = NULL;
 done:
+	pthread_mutex_unlock(&cache_mutex);
 	if (name)
 		free(name);
 	return;
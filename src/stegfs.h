@@ -28,11 +28,13 @@
 
 #define STEGFS_NAME    "stegfs"
 #define STEGFS_VERSION "202X.XX"
+#define STEGFS_FORMAT  "2026.10" /*!< On-disk format written by mkstegfs */
 
 #define PROJECT_URL "https://albinoloverats.net/projects/encrypt"
 
 /* size (in bytes) for various blocks of data */
-#define SIZE_BYTE_BLOCK       0x0800    /*!< 2,048 bytes */
+#define SIZE_BYTE_BLOCK       0x0800    /*!< 2,048 bytes (the default, and the superblock) */
+#define SIZE_BYTE_BLOCK_MAX   0x10000   /*!< 65,536 bytes (largest block size) */
 #define SIZE_BYTE_PATH        0x0020    /*!<    32 bytes */
 #define SIZE_BYTE_DATA_201508 0x07B8    /*!< 1,976 bytes */
 //#define SIZE_BYTE_DATA_202XXX 0x0780    /*!< 1,920 bytes */
@@ -42,6 +44,18 @@
 #define SIZE_BYTE_NEXT        0x0008    /*!<     8 bytes */
 /* next block (not defined) */
 
+/* file data in a block of the given size (whatever isn’t its path, hash or next block) */
+#define SIZE_BYTE_DATA_IN(b) ((b) - SIZE_BYTE_PATH - SIZE_BYTE_HASH - SIZE_BYTE_NEXT)
+
+#define SIZE_BYTE_TAG         0x0010    /*!<    16 bytes (of the hash, in a sealed block; the rest is its salt) */
+#define SIZE_BYTE_NONCE       0x000C    /*!<    12 bytes (IV of a sealed block) */
+#define SIZE_BYTE_SALT        0x0010    /*!<    16 bytes (random, new each time a block is written; its IV is made from it) */
+
+/* cipher modes which seal (encrypt and authenticate) each block, in one pass */
+#define MODE_SEALED(m) ((m) == GCRY_CIPHER_MODE_GCM || (m) == GCRY_CIPHER_MODE_OCB || (m) == GCRY_CIPHER_MODE_POLY1305)
+/* and whether a cipher can be used in such a mode (a 128 bit block cipher, or ChaCha20 with Poly1305) */
+#define MODE_SEALS(m, c) ((m) == GCRY_CIPHER_MODE_POLY1305 ? (c) == GCRY_CIPHER_CHACHA20 : gcry_cipher_get_algo_blklen(c) == 16)
+
 #define SIZE_BYTE_HEAD        0x0400    /*!< 1,024 bytes (data in header block) */
 #define OFFSET_BYTE_HEAD  (SIZE_BYTE_DATA-SIZE_BYTE_HEAD) /*!< Offset of file data in header block */
 
@@ -55,6 +69,14 @@
 
 #define COPIES_MAX 64
 #define COPIES_DEFAULT 8
+#define COPIES_QUEUE_MAX 0x4000000 /*!< 64 MiB of file data waiting to be written to background copies */
+#define SHRED_BATCH 0x40 /*!< Deleted blocks overwritten for each lock of the block tracker */
+#define RANDOM_RESEED 0x1000000 /*!< 16 MiB of padding and shredding from each key before a new one is taken */
+#define SCRATCH_SIZE 0x400 /*!< Secure memory each thread keeps for digests, keys and IVs */
+#define TREE_RUN 0x400 /*!< Fewest nodes of a level of a hash tree worth hashing in a thread of their own */
+#define COPIES_RUN 0x100 /*!< Fewest blocks of a file worth writing each of its copies in a thread of its own */
+#define COMPRESS_FRAME 0x10000 /*!< 64 KiB of file data compressed at a time; each frame can be decompressed on its own */
+#define COMPRESS_RAW 0x80000000 /*!< Set in the header of a frame that didn’t compress, and is stored as it is */
 #define SYM_LENGTH -1
 
 #define SUPER_ID STEGFS_NAME " " STEGFS_VERSION
@@ -96,6 +118,7 @@ typedef enum
 	VERSION_2015_08,
 
 	VERSION_202X_XX,
+	VERSION_2026_10, /*!< Each block is encrypted on its own, with a tweak */
 	VERSION_CURRENT
 }
 version_e;
@@ -111,6 +134,8 @@ version_e;
 
 #define PASSWORD_SEPARATOR ':'
 
+#define XATTR_COPIES "user.stegfs.copies" /*!< Extended attribute holding the copies of a file (or of files made in a directory) */
+
 /*!
  * \brief  Tag (TLV) enum
  *
@@ -128,6 +153,10 @@ typedef enum
 	TAG_DUPLICATION,
 	TAG_MAC,
 	TAG_KDF,
+	TAG_INDEX,
+	TAG_ERASURE,
+	TAG_MERKLE,
+	TAG_COMPRESS,
 	TAG_MAX
 }
 stegfs_tag_e;
@@ -149,6 +178,22 @@ typedef enum
 }
 stegfs_init_e;
 
+/*!
+ * \brief  Chunked file data buffer
+ *
+ * File data held in memory as a list of chunks, each the size of the
+ * data area of the block it will be written to: chunk 0 is the data
+ * stored in the inode (header) block, chunk n is the data of the nth
+ * block of the chain. Growing a file never moves existing data and
+ * chunks which have never been written read back as 0's.
+ */
+typedef struct stegfs_data_s
+{
+	uint8_t **chunk;  /*!< Chunk pointers (NULL if not yet written) */
+	uint64_t  chunks; /*!< Number of chunk pointers allocated */
+}
+stegfs_data_s;
+
 /*!
  * \brief  Structure to hold information about a file
  *
@@ -162,11 +207,29 @@ typedef struct stegfs_file_s
 	char      *pass;               /*!< Password component of /path/file:password */
 	uint64_t   size;               /*!< File size */
 	time_t     time;               /*!< Last modified timestamp */
-	uint8_t   *data;               /*!< File data */
+	stegfs_data_s data;            /*!< File data */
+	uint64_t   dirty;              /*!< Offset of the first byte changed since last read/written (UINT64_MAX if unchanged) */
+	uint64_t   dirty_end;          /*!< Offset after the last byte changed (0 if unknown, in which case everything from dirty has) */
+	uint64_t   allocated;          /*!< Space reserved for the file, which may be beyond its size */
+	uint64_t   reserved;           /*!< Blocks (for all copies) counted against free space but not yet assigned */
+	uint64_t   unloaded;           /*!< Number of blocks (after the head) not yet read in to memory */
+	gcry_md_hd_t mac_state;        /*!< Saved state of the file’s HMAC (if the MAC is an HMAC) */
+	uint64_t   mac_blocks;         /*!< Number of blocks included in the saved HMAC state */
+	uint8_t   *tree;               /*!< Hash tree of the file’s blocks, leaves first (if the file system has them) */
+	uint64_t   tree_leaves;        /*!< Number of blocks the tree was built for */
+	uint64_t   tree_dirty;         /*!< First leaf changed since the tree was last written (counted from 0) */
+	uint64_t   tree_dirty_end;     /*!< And after the last (the same as tree_dirty if none have) */
+	stegfs_data_s packed;          /*!< File data as stored, when it’s compressed */
+	uint64_t   stored;             /*!< Size of the data as stored, when it’s compressed */
+	bool       compressed;         /*!< Whether the file is stored compressed */
 	/* you can’t have more than 64 copies; you just can’t */
 	uint64_t   inodes[COPIES_MAX]; /*!< The available inodes */
 	uint64_t  *blocks[COPIES_MAX]; /*!< The complete list of used blocks */
+	uint64_t  *index[COPIES_MAX];  /*!< The index blocks listing them (if the file system has them) */
+	uint64_t   listed;             /*!< Number of blocks the index on disk lists */
+	uint32_t   copies;             /*!< Number of copies of the file (0 for the file system’s) */
 	bool       write;              /*!< Whether the file was opened for write access */
+	bool       flushing;           /*!< Whether the file is waiting to be (or being) written in the background */
 }
 stegfs_file_s;
 
@@ -184,6 +247,7 @@ typedef struct _stegfs_cache
 	uint64_t ents;                /*!< The number of child elements */
 	struct _stegfs_cache **child; /*!< Array of pointers to child elements */
 	stegfs_file_s *file;          /*!< File details (if applicable) */
+	uint32_t copies;              /*!< Copies of the files made in a directory (0 for its parent’s) */
 }
 stegfs_cache_s;
 
@@ -197,7 +261,9 @@ stegfs_cache_s;
 typedef struct stegfs_blocks_s
 {
 	uint64_t used; /*!< Count of used blocks */
+	uint64_t reserved; /*!< Count of blocks reserved for files not yet written */
 	bool *in_use;  /*!< Used block tracker */
+	bool *shred;   /*!< Free blocks still to be overwritten with random data */
 	char **file;   /*!< File using the given block */
 }
 stegfs_blocks_s;
@@ -225,6 +291,17 @@ typedef struct stegfs_s
 	stegfs_cache_s         cache;          /*!< File cache version 2 */
 	version_e              version;        /*!< File system version */
 	bool                   show_bloc;      /*!< Expose the /bloc/ block list */
+	bool                   async_copies;   /*!< Write all but the first copy of a file in the background */
+	uint64_t               copies_pending; /*!< Copies of files still to be written in the background */
+	uint32_t               flush_threads;  /*!< Threads writing closed files in the background (0 to write them on close) */
+	uint64_t               flush_pending;  /*!< Closed files still to be written in the background */
+	uint64_t               flush_failed;   /*!< Closed files which couldn’t be written in the background */
+	uint64_t               shred_pending;  /*!< Deleted blocks still to be overwritten in the background */
+	bool                   indexed;        /*!< Files list their blocks in index blocks, instead of chaining them */
+	uint32_t               stripe;         /*!< Chains of each file holding its data, the rest hold parity (0 if each is a whole copy) */
+	bool                   merkle;         /*!< Files’ MACs are of the root of a hash tree of their blocks, kept in their index */
+	bool                   compress;       /*!< Files are compressed before they’re encrypted (those that compress) */
+	bool                   read_only;      /*!< Mounted read-only; nothing is written, nor are blocks tracked */
 }
 stegfs_s;
 
@@ -232,7 +309,8 @@ stegfs_s;
  * \brief  Structure for each file system block
  *
  * Simple structure which represents an individual file system data
- * block.
+ * block of the default size; the superblock is always laid out like
+ * this, even when the file system uses larger blocks.
  */
 typedef struct stegfs_block_s
 {
@@ -253,17 +331,23 @@ stegfs_block_s;
  * \param[in]  a  MAC algorithm
  * \param[in]  x  Duplication copies
  * \param[in]  b  Expose the /bloc/ block list
+ * \param[in]  r  Write all but the first copy of a file in the background
+ * \param[in]  w  Number of threads writing closed files in the background
+ * \param[in]  o  Read-only; refuse to change anything
  * \returns       The initialisation status
  *
  * Initialise the file system and popular static information structures,
- * making note whether to cache file details.
+ * making note whether to cache file details. When read-only, which blocks
+ * are used isn’t tracked (there’s nothing to allocate), and the cache can
+ * be searched without taking a lock, so files can be stat’d and read at
+ * once by as many threads as FUSE has.
  */
 extern stegfs_init_e stegfs_init(const char * const restrict f, bool p,
 		enum gcry_cipher_algos c,
 		enum gcry_cipher_modes m,
 		enum gcry_md_algos h,
 		enum gcry_mac_algos a,
-		uint64_t kdf, uint32_t x, bool b);
+		uint64_t kdf, uint32_t x, bool b, bool r, uint32_t w, bool o);
 
 /*!
  * \brief         Retrieve information about the file system
@@ -278,20 +362,25 @@ extern stegfs_s stegfs_info(void);
 /*
  * \brief         Deinitialise the file system
  *
- * Unmount the file system, sync all data, clear all memory.
+ * Unmount the file system, sync all data (waiting for any copies still
+ * being written, and deleted blocks still being shredded, in the
+ * background), clear all memory.
  */
 extern void stegfs_deinit(void);
 
 /*!
  * \brief         Check if a file will fit
  * \param[in]  f  File info structure
+ * \param[in]  z  The size the file will be
  * \return        True if the file will fit
  *
- * Check if there is likely enough remaining capacity of the file system
- * for the given file to fit. It takes in to account the size of the
- * file, duplicated and all known files and their duplicates.
+ * Check if there is enough remaining capacity of the file system for
+ * the given file to grow to the given size, and reserve it. It takes in
+ * to account the blocks the file already has, duplicated, and the
+ * blocks used or reserved by all other files. The reservation is given
+ * back when the file is written.
  */
-extern bool stegfs_file_will_fit(stegfs_file_s *f);
+extern bool stegfs_file_will_fit(stegfs_file_s *f, uint64_t z);
 
 /*!
  * \brief         Create a new file
@@ -328,33 +417,242 @@ extern bool stegfs_file_stat_aux(stegfs_file_s *f, bool q);
  * \param[in]  f  File structure for the file being read
  * \return        True if the file was read successfully
  *
- * Read a file from the file system.
+ * Read a file from the file system. If the file system keeps a hash
+ * tree of each file only the head is read, and the root of the tree
+ * checked; each block is read, and checked, as it’s needed (see
+ * stegfs_file_load).
  */
 extern bool stegfs_file_read(stegfs_file_s *f);
 
+/*!
+ * \brief         Read the end of a file from the file system
+ * \param[in]  f  File structure for the file being read
+ * \return        True if the file was read successfully
+ *
+ * Read just the head and the last block of a file, ready for it to be
+ * appended to. The rest of the file is loaded when it’s needed, see
+ * stegfs_file_load. If the MAC of the file can’t be carried on from
+ * a saved state the whole file is read, as stegfs_file_read.
+ */
+extern bool stegfs_file_read_tail(stegfs_file_s *f);
+
+/*!
+ * \brief         Make sure part of a file is in memory
+ * \param[in]  f  File structure for the file
+ * \param[in]  o  Offset of the start of the data
+ * \param[in]  z  Size of the data
+ * \return        True if the data is loaded
+ *
+ * Make sure the given range of a file which was opened with
+ * stegfs_file_read_tail (or, with a hash tree, stegfs_file_read) is in
+ * memory before it’s read or changed.
+ */
+extern bool stegfs_file_load(stegfs_file_s *f, uint64_t o, uint64_t z);
+
 /*!
  * \brief         Write a file to the file system
  * \param[in]  f  File structure for the file being written
  *
- * Write a file to the file system.
+ * Write a file to the file system. If the file system was initialised
+ * to write copies in the background then only the first copy (and its
+ * inode) is written before returning; the rest are queued, unless the
+ * queue is full, in which case they’re written now. Blocks which were
+ * changed are written in place, so should a write fail part way the
+ * file can’t be read back from the file system until it’s written
+ * again successfully.
  */
 extern bool stegfs_file_write(stegfs_file_s *f);
 
+/*!
+ * \brief         Close a file
+ * \param[in]  f  File structure for the file being closed
+ * \return        True if the file was written (or queued to be)
+ *
+ * Write a file which was open for writing, then forget its data and
+ * password. If the file system was initialised with flush threads the
+ * file is queued for one of them to write and this returns at once; any
+ * failure is then only counted in the file system information. Either
+ * way, a file which couldn’t be written is kept in memory, still open
+ * for writing, to be written when it’s next closed.
+ */
+extern bool stegfs_file_close(stegfs_file_s *f);
+
+/*!
+ * \brief         Wait for a closed file to be written
+ * \param[in]  p  Path of the file
+ *
+ * If the file at the given path is waiting to be written in the
+ * background (see stegfs_file_close), wait until it has been. Anything
+ * which reads or changes a file must wait first.
+ */
+extern void stegfs_file_wait(const char * const restrict p);
+
+/*!
+ * \brief         Change the size of a file
+ * \param[in]  f  File structure for the file being truncated
+ * \param[in]  z  New size of the file
+ * \return        True if the file was truncated successfully
+ *
+ * Change the size of a file. If the file is open for writing only
+ * the in-memory copy is changed and the blocks are updated when the
+ * file is next written; otherwise the change is committed straight
+ * away, rewriting only the blocks after the new end of the file.
+ */
+extern bool stegfs_file_truncate(stegfs_file_s *f, uint64_t z);
+
+/*!
+ * \brief         Reserve space for a file
+ * \param[in]  f  File structure for the file being allocated
+ * \param[in]  z  Size the file can grow to without further allocation
+ * \return        True if the space was reserved successfully
+ *
+ * Assign blocks to each copy of the file so that it can grow to the
+ * given size without the need to find (or fail to find) free blocks
+ * later. The size of the file is unchanged. Reserved blocks are held
+ * for as long as the file is cached; only blocks within the size of
+ * the file are written when it is.
+ */
+extern bool stegfs_file_allocate(stegfs_file_s *f, uint64_t z);
+
+/*!
+ * \brief         Note that part of a file has changed
+ * \param[in]  f  The file
+ * \param[in]  o  Offset of the first byte changed
+ * \param[in]  e  Offset after the last byte changed
+ *
+ * Record that a range of a file has changed, and so needs writing when
+ * the file is next written. In file systems where blocks are encrypted
+ * independently, only the blocks within the range (and any the file
+ * gained or lost) are written again.
+ */
+extern void stegfs_file_dirty(stegfs_file_s *f, uint64_t o, uint64_t e);
+
+/*!
+ * \brief         Change the number of copies of a file
+ * \param[in]  f  File structure for the file
+ * \param[in]  c  Number of copies, up to the file system’s
+ * \return        True if the number of copies was changed
+ *
+ * Set how many copies of a file are kept; the number is recorded in
+ * each inode. Copies no longer wanted are deleted at once, and new
+ * ones are written in full when the file is next written (which, if
+ * it isn’t open for writing, is straight away). When files are striped
+ * the copies are its chains, and there must be more of them than hold
+ * its data; only the number of parity chains changes.
+ */
+extern bool stegfs_file_replicate(stegfs_file_s *f, uint32_t c);
+
+/*!
+ * \brief         Change the number of copies of files made in a directory
+ * \param[in]  p  Path of the directory
+ * \param[in]  c  Number of copies, up to the file system’s (0 for its parent’s)
+ * \return        True if the number of copies was changed
+ *
+ * Set how many copies files made in a directory (or in directories
+ * below it) have. Files already in the directory keep theirs. As
+ * directories aren’t stored, neither is this: it’s only held in the
+ * cache, so is lost when the file system is unmounted.
+ */
+extern bool stegfs_directory_replicate(const char * const restrict p, uint32_t c);
+
+/*!
+ * \brief         Number of copies of new files
+ * \param[in]  p  Path of the directory
+ * \return        The copies a file made in the directory will have
+ *
+ * The number of copies set on the directory or, failing that, on the
+ * nearest directory above it; otherwise the file system’s.
+ */
+extern uint32_t stegfs_directory_copies(const char * const restrict p);
+
 /*!
  * \brief         Delete a file from the file system
  * \param[in]  f  File structure for the file being deleted
  *
- * Delete a file from the file system.
+ * Delete a file from the file system. Its blocks are free at once, but
+ * are overwritten with random data in the background; until they are,
+ * they can’t be read back. If the file is cached, where its blocks are
+ * is already known so they aren’t looked for again.
  */
 extern void stegfs_file_delete(stegfs_file_s *f);
 
+/*!
+ * \brief         Rename a file
+ * \param[in]  f  File structure (from the cache) for the file being renamed
+ * \param[in]  p  The new path of the file, with its password
+ * \return        True if the file was renamed
+ *
+ * Move a file to a new path (or give it a new password). As where its
+ * inodes are, and the keys its blocks are encrypted with, come from its
+ * path, the file is read in full and written again, every copy at once,
+ * under the new path; so there must be room for it twice over. The old
+ * copies are deleted once the new ones have been written, and whatever
+ * was at the new path before is deleted too. Unless only the password
+ * changed, the cache entry given is gone afterwards.
+ */
+extern bool stegfs_file_rename(stegfs_file_s *f, const char * const restrict p);
+
+/*!
+ * \brief         Copy data from one file to another
+ * \param[in]  f  File structure for the file being copied from
+ * \param[in]  i  Offset in that file to copy from
+ * \param[in]  t  File structure for the file being copied to (open for writing)
+ * \param[in]  o  Offset in that file to copy to
+ * \param[in]  z  Number of bytes to copy
+ * \return        True if the data was copied
+ *
+ * Copy part of one file in to another (or another part of the same
+ * file) without it passing through the caller. Bounds checking against
+ * the size of the file copied from is left to the caller. As with any
+ * other change, the copy is written when the file is next written.
+ */
+extern bool stegfs_file_copy(stegfs_file_s *f, uint64_t i, stegfs_file_s *t, uint64_t o, uint64_t z);
+
+/*!
+ * \brief         Read buffered file data
+ * \param[in]  f  File structure holding the data
+ * \param[out] b  Caller allocated buffer to copy the data in to
+ * \param[in]  z  Number of bytes to copy
+ * \param[in]  o  Offset in the file to start copying from
+ *
+ * Copy data out of the file's in-memory chunks; anything never written
+ * is returned as 0's. Bounds checking against the file size is left to
+ * the caller.
+ */
+extern void stegfs_data_read(const stegfs_file_s * const restrict f, void *b, size_t z, uint64_t o);
+
+/*!
+ * \brief         Buffer file data
+ * \param[in]  f  File structure to hold the data
+ * \param[in]  b  The data to buffer
+ * \param[in]  z  Number of bytes to buffer
+ * \param[in]  o  Offset in the file to buffer the data at
+ *
+ * Copy data in to the file's in-memory chunks, allocating new chunks as
+ * necessary; existing chunks are never moved. The file size is not
+ * updated.
+ */
+extern void stegfs_data_write(stegfs_file_s *f, const void *b, size_t z, uint64_t o);
+
+/*!
+ * \brief         Release buffered file data
+ * \param[in]  f  File structure holding the data
+ * \param[in]  z  Number of bytes to keep
+ *
+ * Free all chunks after the given size, and 0 the remainder of the
+ * last chunk that is kept. If the size is 0 all memory used by the
+ * buffer is released.
+ */
+extern void stegfs_data_truncate(stegfs_file_s *f, uint64_t z);
+
 /*!
  * \brief         Add a entry to the cache
  * \param[in]  p  The path of the file to add
  * \param[in]  f  The file info structure of the file to add
  *
  * Add an entry to the in-memory file system cache. This allows things
- * like directory look-ups to work.
+ * like directory look-ups to work. When read-only, an entry is only seen
+ * once it’s complete, and a file’s details, once cached, aren’t replaced.
  */
 extern void stegfs_cache_add(const char * const restrict p, stegfs_file_s *f);
 
@@ -37,5 +37,7 @@ rm -rf %{buildroot}
 %defattr(-,root,root)
 /usr/bin/stegfs
 /usr/bin/mkstegfs
+/usr/bin/stegfs-convert
 /usr/share/man/man1/stegfs.1.gz
 /usr/share/man/man1/mkstegfs.1.gz
+/usr/share/man/man1/stegfs-convert.1.gz